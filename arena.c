@@ -0,0 +1,144 @@
+#include "pcc.h"
+
+#include <stddef.h>
+
+// The default size of a chunk. Objects larger than this are allocated in their
+// own chunks.
+#define CHUNK_SIZE (64 * 1024)
+
+// The alignment of every object allocated in the arena.
+#define ARENA_ALIGN (_Alignof(max_align_t))
+
+/*
+ * A chunk of memory from which objects are carved out by bumping the pointer.
+ */
+struct Chunk {
+  Chunk *next;  // The previously allocated chunk or NULL
+  size_t cap;   // The number of the bytes available in data
+  size_t used;  // The number of the bytes already allocated in data
+  _Alignas(max_align_t) char data[];
+};
+
+/*
+ * Allocates a new zero-filled chunk which can hold at least size bytes and
+ * chains it to the list of the chunks.
+ */
+static Chunk *new_chunk(Context *c, size_t size) {
+  size_t cap = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+  Chunk *chunk = calloc(1, sizeof(Chunk) + cap);
+  if (!chunk) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  chunk->cap = cap;
+  ArenaStats *stats = &c->mem_stats;
+  stats->reserved += cap;
+  if (stats->reserved > stats->peak_reserved) {
+    stats->peak_reserved = stats->reserved;
+  }
+
+  return chunk;
+}
+
+/**
+ * Allocates a zero-filled object in the arena.
+ *
+ * The object is valid until arena_free() is called.
+ *
+ * @param c    the context of the compilation
+ * @param kind the kind of the object, which it is accounted as
+ * @param size the size of the object in bytes
+ * @return the pointer to the allocated object
+ */
+void *arena_alloc(Context *c, MemKind kind, size_t size) {
+  arena_count(c, kind);
+
+  return arena_alloc_block(c, kind, size);
+}
+
+/**
+ * Allocates a zero-filled block in the arena which stores the objects counted
+ * one by one with arena_count(), such as a growable array. Only the bytes of
+ * the block are accounted.
+ *
+ * @param c    the context of the compilation
+ * @param kind the kind of the objects stored in the block
+ * @param size the size of the block in bytes
+ * @return the pointer to the allocated block
+ */
+void *arena_alloc_block(Context *c, MemKind kind, size_t size) {
+  c->mem_stats.bytes[kind] += size;
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  // The chunk objects are currently allocated from. The chunks are chained
+  // from the newest one to the oldest one.
+  Chunk *current = c->chunks;
+  if (!current || current->cap - current->used < size) {
+    Chunk *chunk = new_chunk(c, size);
+    if (current && size > CHUNK_SIZE) {
+      // Keep bumping in the current chunk, which has more room left.
+      chunk->next = current->next;
+      current->next = chunk;
+      chunk->used = size;
+      return chunk->data;
+    }
+    chunk->next = current;
+    current = c->chunks = chunk;
+  }
+
+  void *ptr = current->data + current->used;
+  current->used += size;
+
+  return ptr;
+}
+
+/**
+ * Accounts an object of the kind, which is stored in a block allocated by
+ * arena_alloc_block().
+ *
+ * @param c the context of the compilation
+ * @param kind the kind of the object
+ */
+void arena_count(Context *c, MemKind kind) {
+  c->mem_stats.count[kind]++;
+}
+
+/**
+ * Duplicates at most n bytes of the string into the arena.
+ *
+ * @param c the context of the compilation
+ * @param s the string to be duplicated
+ * @param n the maximum number of the bytes to be duplicated
+ * @return the null-terminated copy of the string
+ */
+char *arena_strndup(Context *c, const char *s, size_t n) {
+  size_t len = strnlen(s, n);
+  char *copy = arena_alloc(c, MEM_STRING, len + 1);
+  memcpy(copy, s, len);
+
+  return copy;
+}
+
+/**
+ * Releases all objects allocated in the arena of the context at once.
+ *
+ * @param c the context of the compilation
+ */
+void arena_free(Context *c) {
+  while (c->chunks) {
+    Chunk *next = c->chunks->next;
+    c->mem_stats.reserved -= c->chunks->cap;
+    free(c->chunks);
+    c->chunks = next;
+  }
+}
+
+/**
+ * Returns the statistics of the allocations of the compilation.
+ *
+ * @param c the context of the compilation
+ * @return the statistics of the arena
+ */
+const ArenaStats *arena_stats(const Context *c) {
+  return &c->mem_stats;
+}
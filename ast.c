@@ -0,0 +1,124 @@
+#include "pcc.h"
+
+/*
+ * Allocates the arrays of the nodes with the capacity in one block of the
+ * arena and copies the existing nodes into them.
+ */
+static void resize(Context *c, Ast *ast, int cap) {
+  // The 32bit fields come first to keep them aligned.
+  size_t size = sizeof(NodeId) * 3 + sizeof(int32_t) + sizeof(uint8_t);
+  char *block = arena_alloc_block(c, MEM_NODE, size * cap);
+  NodeId *lhs = (NodeId *)block;
+  NodeId *rhs = lhs + cap;
+  NodeId *next = rhs + cap;
+  int32_t *val = next + cap;
+  uint8_t *kind = (uint8_t *)(val + cap);
+
+  if (ast->len) {
+    memcpy(lhs, ast->lhs, sizeof(NodeId) * ast->len);
+    memcpy(rhs, ast->rhs, sizeof(NodeId) * ast->len);
+    memcpy(next, ast->next, sizeof(NodeId) * ast->len);
+    memcpy(val, ast->val, sizeof(int32_t) * ast->len);
+    memcpy(kind, ast->kind, sizeof(uint8_t) * ast->len);
+  }
+  ast->lhs = lhs;
+  ast->rhs = rhs;
+  ast->next = next;
+  ast->val = val;
+  ast->kind = kind;
+  ast->cap = cap;
+}
+
+/**
+ * Creates an empty AST.
+ *
+ * The arrays are allocated for the expected number of the nodes up front
+ * and grown by doubling beyond it, leaving the old ones in the arena.
+ *
+ * @param c the context of the compilation
+ * @param cap the expected number of the nodes, which are grown beyond
+ * @return the new AST
+ */
+Ast *new_ast(Context *c, int cap) {
+  // The nodes are counted one by one as they are added.
+  Ast *ast = arena_alloc_block(c, MEM_NODE, sizeof(Ast));
+  resize(c, ast, cap > 0 ? cap + 1 : 16);
+  // Reserve the null node.
+  ast->len = 1;
+
+  return ast;
+}
+
+/**
+ * Appends the node to the AST.
+ *
+ * @param c the context of the compilation
+ * @param ast the AST
+ * @param kind the kind of the node
+ * @param lhs the lhs of the node
+ * @param rhs the rhs of the node
+ * @return the index of the new node
+ */
+NodeId add_node(Context *c, Ast *ast, NodeKind kind, NodeId lhs, NodeId rhs) {
+  if (ast->len == ast->cap) {
+    resize(c, ast, ast->cap * 2);
+  }
+
+  arena_count(c, MEM_NODE);
+  NodeId node = ast->len++;
+  ast->kind[node] = kind;
+  ast->lhs[node] = lhs;
+  ast->rhs[node] = rhs;
+
+  return node;
+}
+
+/**
+ * Appends the name of the called function to the AST.
+ *
+ * @param c the context of the compilation
+ * @param ast the AST
+ * @param name the interned name of the function
+ * @return the index of the name in callees
+ */
+int add_callee(Context *c, Ast *ast, const char *name) {
+  if (ast->num_callees == ast->cap_callees) {
+    int cap = ast->cap_callees ? ast->cap_callees * 2 : 16;
+    const char **callees = arena_alloc_block(c, MEM_NODE, sizeof(char *) * cap);
+    if (ast->num_callees) {
+      memcpy(callees, ast->callees, sizeof(char *) * ast->num_callees);
+    }
+    ast->callees = callees;
+    ast->cap_callees = cap;
+  }
+
+  ast->callees[ast->num_callees] = name;
+
+  return ast->num_callees++;
+}
+
+/**
+ * Returns the comparison negated by the node, which the optimizer writes as
+ * the comparison == 0, so that the branches on the node are fused with it.
+ *
+ * @param ast the AST
+ * @param node the node
+ * @return the negated comparison, or 0 if the node is not of the form
+ */
+NodeId negated_cmp(const Ast *ast, NodeId node) {
+  if (ast->kind[node] != ND_EQ || ast->kind[ast->rhs[node]] != ND_NUM ||
+      ast->val[ast->rhs[node]]) {
+    return 0;
+  }
+
+  NodeId cmp = ast->lhs[node];
+  switch (ast->kind[cmp]) {
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      return cmp;
+    default:
+      return 0;
+  }
+}
@@ -0,0 +1,403 @@
+// Compile-throughput benchmark of pcc.
+//
+// Synthetic programs are generated with the statement count, the number of
+// the local variables, the expression depth and the loop nesting scaled up
+// one at a time. Each program is compiled in a forked child process so that
+// every sample starts with a fresh heap like a real pcc run, and the time of
+// each phase is measured. The benchmark fails when the time of a phase grows
+// faster than the scaling threshold relative to the input size.
+
+#include "pcc.h"
+
+#include <math.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The number of the samples per program. The fastest one is reported.
+#define NUM_SAMPLES 5
+
+// The maximum exponent k of the time growth t ~ n^k over the input size n of
+// the phase, which is the number of the tokens for the frontend, the number of
+// the nodes for the optimizer and the code generator and the size of the
+// assembly for the rest. The phases are expected to be linear and anything
+// close to quadratic fails.
+#define MAX_SCALING 1.8
+
+// The samples of a phase below this time are too fast to tell the scaling
+// from noise and left out of the fit.
+#define MIN_SCALING_TIME 5e-3
+
+// The minimum number of the samples to fit the exponent to.
+#define MIN_SCALING_POINTS 3
+
+/*
+ * The phases of the compilation
+ */
+enum {
+  PH_TOKENIZE,
+  PH_PARSE,
+  PH_OPTIMIZE,
+  PH_CODEGEN,
+  PH_PEEPHOLE,
+  PH_EMIT,
+  NUM_PHASES,
+};
+
+static const char *phase_names[] = {
+  "tokenize", "parse", "optimize", "codegen", "peephole", "emit",
+};
+
+/*
+ * The parameters of the generated program
+ */
+typedef struct {
+  int stmts;    // The number of the statements
+  int locals;   // The number of the local variables
+  int depth;    // The depth of each expression
+  int nesting;  // The nesting level of the loops around the statements
+} GenParams;
+
+/*
+ * The parameter scaled in a series
+ */
+typedef enum {
+  SC_STMTS,
+  SC_LOCALS,
+  SC_DEPTH,
+  SC_NESTING,
+} Scale;
+
+static const char *scale_names[] = {"stmts", "locals", "depth", "nesting"};
+
+/*
+ * The result of compiling a program once
+ */
+typedef struct {
+  double times[NUM_PHASES];  // The time of each phase in seconds
+  long tokens;               // The number of the tokens
+  long nodes;                // The number of the AST nodes
+  long asm_bytes;            // The size of the generated assembly code
+} Sample;
+
+/*
+ * The growable string buffer for the generated program
+ */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+/*
+ * Appends the formatted string to the buffer.
+ */
+static void buf_printf(Buf *buf, const char *fmt, ...) {
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+    if (buf->len + n < buf->cap) {
+      buf->len += n;
+      return;
+    }
+    buf->cap = buf->cap ? buf->cap * 2 : 4096;
+    buf->data = realloc(buf->data, buf->cap);
+  }
+}
+
+/*
+ * Generates the expression of the given depth over the local variables.
+ */
+static void gen_expr(Buf *buf, int depth, int *seed, int locals) {
+  static const char *ops[] = {"+", "-", "*", "+", "<", "=="};
+
+  if (depth == 0) {
+    *seed = *seed * 1103515245 + 12345;
+    int r = (*seed >> 16) & 0x7fff;
+    if (r % 3) {
+      buf_printf(buf, "v%d", r % locals);
+    } else {
+      buf_printf(buf, "%d", r % 100);
+    }
+    return;
+  }
+
+  buf_printf(buf, "(");
+  gen_expr(buf, depth - 1, seed, locals);
+  buf_printf(buf, " %s ", ops[depth % 6]);
+  gen_expr(buf, 0, seed, locals);
+  buf_printf(buf, ")");
+}
+
+/*
+ * Generates the program. Every local variable is defined first, and the
+ * statements assigning the expressions to them are wrapped by the nested
+ * loops in groups of eight.
+ */
+static char *gen_program(const GenParams *params) {
+  Buf buf = {};
+  int seed = 42;
+
+  for (int i = 0; i < params->locals; i++) {
+    buf_printf(&buf, "v%d = %d;\n", i, i % 10);
+  }
+
+  for (int i = 0; i < params->stmts; i += 8) {
+    for (int n = 0; n < params->nesting; n++) {
+      buf_printf(&buf, "for (i%d = 0; i%d < 2; i%d = i%d + 1) {\n",
+                 n, n, n, n);
+    }
+    for (int j = i; j < i + 8 && j < params->stmts; j++) {
+      buf_printf(&buf, "v%d = ", j % params->locals);
+      gen_expr(&buf, params->depth, &seed, params->locals);
+      buf_printf(&buf, ";\n");
+    }
+    for (int n = 0; n < params->nesting; n++) {
+      buf_printf(&buf, "}\n");
+    }
+  }
+  buf_printf(&buf, "v0;\n");
+
+  return buf.data;
+}
+
+/*
+ * Returns the current time of the monotonic clock in seconds.
+ */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Compiles the program once and measures the phases.
+ */
+static Sample compile(char *src) {
+  Sample s = {};
+  double t0 = now();
+
+  Context *c = context_new("<bench>", src);
+  tokenize(c);
+  double t1 = now();
+  s.tokens = c->num_tokens;
+
+  double t2 = now();
+  Function *prog = program(c);
+  double t3 = now();
+  s.nodes = prog->ast->len - 1;
+
+  double t4 = now();
+  optimize(c, prog);
+  double t5 = now();
+  InsnList *insns = codegen(c, prog);
+  double t6 = now();
+  peephole(c, insns);
+  double t7 = now();
+  emit_asm(c, insns);
+  double t8 = now();
+  s.asm_bytes = emit_size(c);
+
+  s.times[PH_TOKENIZE] = t1 - t0;
+  s.times[PH_PARSE] = t3 - t2;
+  s.times[PH_OPTIMIZE] = t5 - t4;
+  s.times[PH_CODEGEN] = t6 - t5;
+  s.times[PH_PEEPHOLE] = t7 - t6;
+  s.times[PH_EMIT] = t8 - t7;
+
+  return s;
+}
+
+/*
+ * Compiles the program in a child process and returns its measurement.
+ */
+static Sample run_sample(char *src) {
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    exit(1);
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    Sample s = compile(src);
+    if (write(fds[1], &s, sizeof(s)) != sizeof(s)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(fds[1]);
+  Sample s;
+  ssize_t n = read(fds[0], &s, sizeof(s));
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (n != sizeof(s) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "The compilation failed in the benchmark.\n");
+    exit(1);
+  }
+
+  return s;
+}
+
+/*
+ * Compiles the program several times and returns the fastest time of each
+ * phase.
+ */
+static Sample measure(const GenParams *params) {
+  char *src = gen_program(params);
+  Sample best = run_sample(src);
+  for (int i = 1; i < NUM_SAMPLES; i++) {
+    Sample s = run_sample(src);
+    for (int p = 0; p < NUM_PHASES; p++) {
+      if (s.times[p] < best.times[p]) {
+        best.times[p] = s.times[p];
+      }
+    }
+  }
+  free(src);
+
+  return best;
+}
+
+/*
+ * Returns the size of the input of the phase, against which its time is
+ * expected to grow linearly.
+ */
+static double phase_input(const Sample *s, int phase) {
+  switch (phase) {
+    case PH_TOKENIZE:
+    case PH_PARSE:
+      return s->tokens;
+    case PH_OPTIMIZE:
+    case PH_CODEGEN:
+      return s->nodes;
+    default:
+      return s->asm_bytes;
+  }
+}
+
+/*
+ * Runs the series of the programs scaled by one parameter, prints the
+ * throughput and checks the scaling of each phase. Returns false if any phase
+ * scales superlinearly.
+ */
+static bool run_series(GenParams params, Scale scale, const int *values,
+                       int num_values) {
+  const char *name = scale_names[scale];
+  Sample samples[16];
+
+  printf("== %s\n", name);
+  printf("%8s %9s %9s", name, "tokens", "nodes");
+  for (int ph = 0; ph < NUM_PHASES; ph++) {
+    printf(" %9s", phase_names[ph]);
+  }
+  printf(" %10s %10s %10s\n", "Mtok/s", "Mnode/s", "MB asm/s");
+
+  for (int i = 0; i < num_values; i++) {
+    switch (scale) {
+      case SC_STMTS:
+        params.stmts = values[i];
+        break;
+      case SC_LOCALS:
+        params.locals = values[i];
+        break;
+      case SC_DEPTH:
+        params.depth = values[i];
+        break;
+      case SC_NESTING:
+        params.nesting = values[i];
+        break;
+    }
+    Sample *s = &samples[i];
+    *s = measure(&params);
+
+    printf("%8d %9ld %9ld", values[i], s->tokens, s->nodes);
+    for (int ph = 0; ph < NUM_PHASES; ph++) {
+      printf(" %7.2fms", s->times[ph] * 1e3);
+    }
+    double gen_time = s->times[PH_CODEGEN] + s->times[PH_PEEPHOLE] +
+        s->times[PH_EMIT];
+    printf(" %10.2f %10.2f %10.2f\n",
+           s->tokens / s->times[PH_TOKENIZE] / 1e6,
+           s->nodes / s->times[PH_PARSE] / 1e6,
+           s->asm_bytes / gen_time / 1e6);
+  }
+
+  // Fit the exponent by the least squares on the log-log scale over all the
+  // samples slow enough to measure, so that no single noisy sample decides it.
+  bool ok = true;
+  printf("scaling (time ~ input^k):");
+  for (int ph = 0; ph < NUM_PHASES; ph++) {
+    int n = 0;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < num_values; i++) {
+      if (samples[i].times[ph] < MIN_SCALING_TIME) {
+        continue;
+      }
+      double x = log(phase_input(&samples[i], ph));
+      double y = log(samples[i].times[ph]);
+      n++;
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+    }
+    double d = n * sxx - sx * sx;
+    if (n < MIN_SCALING_POINTS || d <= 0) {
+      printf(" %s=n/a", phase_names[ph]);
+      continue;
+    }
+    double k = (n * sxy - sx * sy) / d;
+    printf(" %s=%.2f", phase_names[ph], k);
+    if (k > MAX_SCALING) {
+      ok = false;
+    }
+  }
+  printf("\n");
+  if (!ok) {
+    printf("FAIL: %s: a phase scales worse than n^%.1f\n", name, MAX_SCALING);
+  }
+  printf("\n");
+
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+  GenParams base = { .stmts = 2000, .locals = 64, .depth = 4, .nesting = 1 };
+
+  static const int stmts[] = {2000, 4000, 8000, 16000, 32000};
+  ok &= run_series(base, SC_STMTS, stmts, 5);
+
+  // Only the definitions of the local variables, one statement each.
+  static const int locals[] = {4000, 8000, 16000, 32000, 64000};
+  GenParams wide = base;
+  wide.stmts = 0;
+  ok &= run_series(wide, SC_LOCALS, locals, 5);
+
+  static const int depths[] = {16, 32, 64, 128, 256};
+  GenParams deep = base;
+  deep.stmts = 200;
+  ok &= run_series(deep, SC_DEPTH, depths, 5);
+
+  static const int nestings[] = {4, 8, 16, 32, 64};
+  ok &= run_series(base, SC_NESTING, nestings, 5);
+
+  if (!ok) {
+    printf("Benchmark FAILED\n");
+    return 1;
+  }
+  printf("Benchmark OK\n");
+
+  return 0;
+}
@@ -0,0 +1,12 @@
+int foo();
+int bar(int a, int b);
+
+int main() {
+  long s, i;
+
+  s = 0;
+  for (i = 0; i < 10000000; i = i + 1) {
+    s = bar(s, foo()) - 41;
+  }
+  return s - s / 256 * 256;
+}
@@ -0,0 +1,18 @@
+int main() {
+  long r, n, a, b, i, t;
+
+  r = 0;
+  for (n = 0; n < 200000; n = n + 1) {
+    a = 0;
+    b = 1;
+    for (i = 0; i < 90; i = i + 1) {
+      t = b;
+      b = a + b;
+      a = t;
+      if (b >= 1000000007) b = b - 1000000007;
+    }
+    r = r + b;
+    if (r >= 1000000007) r = r - 1000000007;
+  }
+  return r - r / 256 * 256;
+}
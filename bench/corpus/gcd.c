@@ -0,0 +1,18 @@
+int main() {
+  long s, i, j, a, b, t;
+
+  s = 0;
+  for (i = 1; i < 2000; i = i + 1) {
+    for (j = 1; j < 500; j = j + 1) {
+      a = i;
+      b = j;
+      while (b != 0) {
+        t = a - a / b * b;
+        a = b;
+        b = t;
+      }
+      s = s + a;
+    }
+  }
+  return s - s / 256 * 256;
+}
@@ -0,0 +1,13 @@
+int main() {
+  long s, i, j, k;
+
+  s = 0;
+  for (i = 0; i < 1000; i = i + 1) {
+    for (j = 0; j < 1000; j = j + 1) {
+      for (k = 0; k < 20; k = k + 1) {
+        s = s + i * j - k;
+      }
+    }
+  }
+  return s - s / 256 * 256;
+}
@@ -0,0 +1,262 @@
+// Runtime benchmark of the code generated by pcc.
+//
+// Each program of the corpus in bench/corpus is compiled by pcc with both
+// backends and its C equivalent is compiled by the system compiler at -O0 and
+// -O2. The binaries are run several times and the fastest wall time and the
+// number of the instructions executed in the user space are reported. The
+// helper functions in test.c are compiled once with -O2 and linked to every
+// binary, so only the code of the program itself differs between the builds.
+//
+// Run it from the top directory of the repository after building pcc. The
+// system compiler is taken from $CC and defaults to cc.
+
+#define _DEFAULT_SOURCE  // For mkdtemp and syscall
+
+#include <linux/perf_event.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The number of the runs per binary. The fastest one is reported.
+#define NUM_SAMPLES 5
+
+// The programs in bench/corpus. Each has <name>.pcc and its C equivalent
+// <name>.c, which must exit with the same status.
+static const char *programs[] = {"fib", "loops", "calls", "gcd"};
+
+#define NUM_PROGRAMS ((int)(sizeof(programs) / sizeof(*programs)))
+
+/*
+ * The ways to build a program
+ */
+enum {
+  BD_PCC,
+  BD_PCC_IR,
+  BD_CC_O0,
+  BD_CC_O2,
+  NUM_BUILDS,
+};
+
+static const char *build_names[] = {"pcc", "pcc --ir", "cc -O0", "cc -O2"};
+
+/*
+ * The result of running a binary
+ */
+typedef struct {
+  int status;         // The exit status
+  double time;        // The wall time in seconds
+  long instructions;  // The instructions executed, or -1 if not available
+} Run;
+
+// The system compiler.
+static const char *cc;
+
+// The directory the binaries are built in.
+static char work_dir[] = "/tmp/pcc-runtime-XXXXXX";
+
+/*
+ * Runs the shell command and exits on failure.
+ */
+static void run_command(const char *fmt, ...) {
+  char cmd[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(cmd, sizeof(cmd), fmt, ap);
+  va_end(ap);
+
+  if (system(cmd)) {
+    fprintf(stderr, "The command failed: %s\n", cmd);
+    exit(1);
+  }
+}
+
+/*
+ * Builds the program in the given way and returns the path of the binary.
+ */
+static char *build(const char *name, int bd) {
+  char *bin = malloc(256);
+  snprintf(bin, 256, "%s/%s-%d", work_dir, name, bd);
+
+  switch (bd) {
+    case BD_PCC:
+    case BD_PCC_IR:
+      run_command("./pcc %s -o %s.s bench/corpus/%s.pcc",
+                  bd == BD_PCC_IR ? "--ir" : "", bin, name);
+      // pcc doesn't emit the .note.GNU-stack section.
+      run_command("%s -Wl,-z,noexecstack -o %s %s.s %s/test.o", cc, bin, bin,
+                  work_dir);
+      break;
+    case BD_CC_O0:
+    case BD_CC_O2:
+      run_command("%s %s -o %s bench/corpus/%s.c %s/test.o", cc,
+                  bd == BD_CC_O2 ? "-O2" : "-O0", bin, name, work_dir);
+      break;
+  }
+
+  return bin;
+}
+
+/*
+ * Returns the current time of the monotonic clock in seconds.
+ */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Opens the counter of the user space instructions of the process, which
+ * starts counting when the process calls exec. Returns -1 if the hardware
+ * counters are not available, e.g. in a virtual machine.
+ */
+static int open_counter(pid_t pid) {
+  struct perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/*
+ * Runs the binary once. The child waits on the pipe until the counter is
+ * attached to it, so that the count covers the whole execution.
+ */
+static Run run_once(const char *bin) {
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    exit(1);
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    char c;
+    close(fds[1]);
+    if (read(fds[0], &c, 1) != 1) {
+      _exit(127);
+    }
+    execl(bin, bin, (char *)NULL);
+    _exit(127);
+  }
+
+  close(fds[0]);
+  int counter = open_counter(pid);
+  double start = now();
+  if (write(fds[1], "x", 1) != 1) {
+    perror("write");
+    exit(1);
+  }
+  close(fds[1]);
+  int status;
+  waitpid(pid, &status, 0);
+
+  Run r = {};
+  r.time = now() - start;
+  r.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  r.instructions = -1;
+  if (counter >= 0) {
+    uint64_t count;
+    if (read(counter, &count, sizeof(count)) == sizeof(count)) {
+      r.instructions = count;
+    }
+    close(counter);
+  }
+
+  return r;
+}
+
+/*
+ * Runs the binary several times and returns the fastest run.
+ */
+static Run measure(const char *bin) {
+  Run best = run_once(bin);
+  for (int i = 1; i < NUM_SAMPLES; i++) {
+    Run r = run_once(bin);
+    if (r.time < best.time) {
+      best.time = r.time;
+    }
+    if (r.instructions >= 0 &&
+        (best.instructions < 0 || r.instructions < best.instructions)) {
+      best.instructions = r.instructions;
+    }
+  }
+
+  return best;
+}
+
+/*
+ * Builds and runs every build of the program and prints the results relative
+ * to cc -O2. Returns false if the builds disagree on the exit status.
+ */
+static bool run_program(const char *name) {
+  Run runs[NUM_BUILDS];
+  for (int bd = 0; bd < NUM_BUILDS; bd++) {
+    char *bin = build(name, bd);
+    runs[bd] = measure(bin);
+    free(bin);
+  }
+
+  bool ok = true;
+  const Run *base = &runs[BD_CC_O2];
+  for (int bd = 0; bd < NUM_BUILDS; bd++) {
+    const Run *r = &runs[bd];
+    printf("%-8s %-9s %6d %10.2fms %7.2fx", name, build_names[bd], r->status,
+           r->time * 1e3, r->time / base->time);
+    if (r->instructions >= 0 && base->instructions > 0) {
+      printf(" %14ld %7.2fx\n", r->instructions,
+             (double)r->instructions / base->instructions);
+    } else {
+      printf(" %14s %8s\n", "n/a", "n/a");
+    }
+    if (r->status != base->status) {
+      ok = false;
+    }
+  }
+  if (!ok) {
+    printf("FAIL: %s: the builds exit with different statuses\n", name);
+  }
+
+  return ok;
+}
+
+int main() {
+  cc = getenv("CC") ? getenv("CC") : "cc";
+  if (!mkdtemp(work_dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  run_command("%s -O2 -c -o %s/test.o test.c", cc, work_dir);
+
+  bool ok = true;
+  printf("%-8s %-9s %6s %12s %8s %14s %8s\n", "program", "build", "status",
+         "time", "vs -O2", "instructions", "vs -O2");
+  for (int i = 0; i < NUM_PROGRAMS; i++) {
+    ok &= run_program(programs[i]);
+  }
+  run_command("rm -rf %s", work_dir);
+
+  if (!ok) {
+    printf("Benchmark FAILED\n");
+    return 1;
+  }
+  printf("Benchmark OK\n");
+
+  return 0;
+}
@@ -1,222 +1,509 @@
 #include "pcc.h"
 
-static int label_seq = 0;
+static const Reg arg_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
 
-static const char* arg_regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+#define NUM_ARG_REGS ((int)(sizeof(arg_regs) / sizeof(*arg_regs)))
 
-static void gen(const Node *node);
+// The registers that hold the temporary values of the expressions. They are
+// allocated like a stack: the n-th live temporary lives in
+// tmp_regs[n % NUM_TMP_REGS]. When all registers are occupied, the previous
+// value of the register is spilled to the machine stack and restored when the
+// temporary is released. RAX and RDX are kept out of the set because idiv and
+// setcc use them as scratch registers.
+static const Reg tmp_regs[] = {R10, R11, R8, R9, RCX, RSI, RDI};
+
+#define NUM_TMP_REGS ((int)(sizeof(tmp_regs) / sizeof(*tmp_regs)))
+
+/*
+ * The state of the code generation of a function
+ */
+typedef struct {
+  Context *c;      // The context of the compilation
+  InsnList *out;   // The instructions being generated
+  const Ast *ast;  // The AST of the function
+  LVar **vars;     // The local variables of the function
+  int top;         // The number of the live temporaries
+  int depth;       // The number of the 8 bytes pushed below the frame, which
+                   // is tracked to align RSP to 16 bytes at the calls
+} Gen;
+
+static void gen_stmt(Gen *g, NodeId node, bool tail);
+static void gen_expr(Gen *g, NodeId node);
+static void gen_leave(Gen *g);
+static void gen_epilogue(Gen *g);
+
+/*
+ * Appends the instruction without operands.
+ */
+static void insn0(Gen *g, InsnKind kind) {
+  add_insn(g->c, g->out, kind, (Operand){}, (Operand){});
+}
+
+/*
+ * Appends the instruction with a single operand.
+ */
+static void insn1(Gen *g, InsnKind kind, Operand dst) {
+  add_insn(g->c, g->out, kind, dst, (Operand){});
+}
+
+/*
+ * Appends the instruction with two operands.
+ */
+static void insn2(Gen *g, InsnKind kind, Operand dst, Operand src) {
+  add_insn(g->c, g->out, kind, dst, src);
+}
+
+/*
+ * Pushes the operand onto the stack.
+ */
+static void push(Gen *g, Operand opd) {
+  insn1(g, IN_PUSH, opd);
+  g->depth++;
+}
+
+/*
+ * Pops the value on the stack into the operand.
+ */
+static void pop(Gen *g, Operand opd) {
+  insn1(g, IN_POP, opd);
+  g->depth--;
+}
 
 /*
- * Generate a series of assembly code that pushes the left value to the stack
- * and output it to stdout.
+ * Returns the register that holds the temporary at the given depth.
  */
-static void gen_lval(const Node *node) {
-  if (node->kind != ND_LVAR) {
-    error_at(token->str, "The left hand side of the assiment is not left value.");
+static Operand reg(int depth) {
+  return opd_reg(tmp_regs[depth % NUM_TMP_REGS]);
+}
+
+/*
+ * Allocates a new temporary and returns its register. The previous value of
+ * the register is spilled to the stack if all registers are in use.
+ */
+static Operand push_reg(Gen *g) {
+  if (g->top >= NUM_TMP_REGS) {
+    push(g, reg(g->top));
   }
 
-  printf("  mov rax, rbp\n");
-  printf("  sub rax, %d\n", node->lvar->offset);
-  printf("  push rax\n");
+  return reg(g->top++);
+}
+
+/*
+ * Releases the temporary on the top. The spilled value is restored if any.
+ */
+static void pop_reg(Gen *g) {
+  g->top--;
+  if (g->top >= NUM_TMP_REGS) {
+    pop(g, reg(g->top));
+  }
 }
 
 /*
- * Generates a series of assembly code for the if statement.
+ * Returns the offset from RBP of the local variable to be assigned.
  */
-static void gen_if(const Node *node) {
-  if (node->kind != ND_IF) {
-    error_at(token->str, "Not an if statement.");
+static int gen_lval(Gen *g, NodeId node) {
+  if (g->ast->kind[node] != ND_LVAR) {
+    error_at(g->c, g->c->token->str, "The left hand side of the assiment is not left value.");
   }
 
+  return g->vars[g->ast->val[node]]->offset;
+}
+
+/*
+ * Returns the conditional jump taken when the comparison of the kind is
+ * equal to the condition.
+ */
+static InsnKind cond_jump(NodeKind kind, bool cond) {
+  switch (kind) {
+    case ND_EQ:
+      return cond ? IN_JE : IN_JNE;
+    case ND_NE:
+      return cond ? IN_JNE : IN_JE;
+    case ND_LT:
+      return cond ? IN_JL : IN_JGE;
+    default:
+      return cond ? IN_JLE : IN_JG;
+  }
+}
+
+/*
+ * Generates the code jumping to the label when the truth of the expression
+ * is equal to the condition. The comparisons are fused into cmp and the
+ * conditional jump without materializing their values.
+ */
+static void gen_branch(Gen *g, NodeId node, bool cond, Operand label) {
+  // Branch on the negated comparison the other way.
+  NodeId cmp = negated_cmp(g->ast, node);
+  if (cmp) {
+    gen_branch(g, cmp, !cond, label);
+    return;
+  }
+
+  switch (g->ast->kind[node]) {
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      gen_expr(g, g->ast->lhs[node]);
+      gen_expr(g, g->ast->rhs[node]);
+      insn2(g, IN_CMP, reg(g->top - 2), reg(g->top - 1));
+      // pop doesn't change the flags.
+      pop_reg(g);
+      pop_reg(g);
+      insn1(g, cond_jump(g->ast->kind[node], cond), label);
+      return;
+    case ND_NUM:
+      // The constant condition either always jumps or never does.
+      if ((g->ast->val[node] != 0) == cond) {
+        insn1(g, IN_JMP, label);
+      }
+      return;
+  }
+
+  gen_expr(g, node);
+  insn2(g, IN_CMP, reg(g->top - 1), opd_imm(0));
+  pop_reg(g);
+  insn1(g, cond ? IN_JNE : IN_JE, label);
+}
+
+/*
+ * Generates a series of assembly code for the if statement. The bodies are in
+ * the tail position if the statement is.
+ */
+static void gen_if(Gen *g, NodeId node, bool tail) {
+  if (g->ast->kind[node] != ND_IF) {
+    error_at(g->c, g->c->token->str, "Not an if statement.");
+  }
+
+  Operand l_else = opd_label("else", g->c->label_seq++);
+  Operand l_end = opd_label("end", g->c->label_seq++);
   // Generate the condition code.
-  gen(node->lhs);
-  printf("  pop rax\n");
-  printf("  cmp rax, 0\n");
-  printf("  je .L.else.%d\n", label_seq);
-  const Node *bodies = node->rhs;
+  gen_branch(g, g->ast->lhs[node], false, l_else);
   // Generate the body code.
-  gen(bodies->lhs);
-  printf("  jmp .L.end.%d\n", label_seq);
-  printf(".L.else.%d:\n", label_seq);
+  gen_stmt(g, g->ast->rhs[node], tail);
+  insn1(g, IN_JMP, l_end);
+  insn1(g, IN_LABEL, l_else);
   // Generate the else body code if any.
-  if (bodies->rhs) {
-    gen(bodies->rhs);
+  if (g->ast->val[node]) {
+    gen_stmt(g, g->ast->val[node], tail);
   }
-  printf(".L.end.%d:\n", label_seq);
-  label_seq++;
+  insn1(g, IN_LABEL, l_end);
 }
 
 /*
  * Generates a series of assembly code for the while statement.
+ *
+ * The loop is rotated: the condition is checked once on entry to skip the
+ * loop and then at the bottom to jump back, so that each iteration takes a
+ * single conditional jump.
  */
-static void gen_while(const Node *node) {
-  if (node->kind != ND_WHILE) {
-    error_at(token->str, "Not a while statement.");
-  }
-
-  printf(".L.begin.%d:\n", label_seq);
-  // Generate the condition code;
-  gen(node->lhs);
-  printf("  pop rax\n");
-  printf("  cmp rax, 0\n");
-  printf("  je .L.end.%d\n", label_seq);
-  gen(node->rhs);
-  printf("  jmp .L.begin.%d\n", label_seq);
-  printf(".L.end.%d:\n", label_seq);
-  label_seq++;
+static void gen_while(Gen *g, NodeId node) {
+  if (g->ast->kind[node] != ND_WHILE) {
+    error_at(g->c, g->c->token->str, "Not a while statement.");
+  }
+
+  Operand l_begin = opd_label("begin", g->c->label_seq++);
+  Operand l_end = opd_label("end", g->c->label_seq++);
+  // Generate the condition code guarding the loop.
+  gen_branch(g, g->ast->lhs[node], false, l_end);
+  insn1(g, IN_LABEL, l_begin);
+  gen_stmt(g, g->ast->rhs[node], false);
+  // Generate the condition code again to repeat the loop.
+  gen_branch(g, g->ast->lhs[node], true, l_begin);
+  insn1(g, IN_LABEL, l_end);
 }
 
 /*
- * Generates a series of assembly code for the for statement.
+ * Generates a series of assembly code for the for statement. The loop is
+ * rotated like the while statement. The declaration clause has been put
+ * before the statement by the parser.
  */
-static void gen_for(const Node *node) {
-  if (node->kind != ND_FOR) {
-    error_at(token->str, "Not a for statement.");
+static void gen_for(Gen *g, NodeId node) {
+  if (g->ast->kind[node] != ND_FOR) {
+    error_at(g->c, g->c->token->str, "Not a for statement.");
   }
 
-  // Generate the code for the declaration clause.
-  const Node * const decl = node->lhs;
-  if (decl) {
-    gen(decl);
-  }
-  const Node *rest = node->rhs;
-  printf(".L.begin.%d:\n", label_seq);
-  // Generate the code for the condition clause.
-  const Node * const cond = rest->lhs;
+  Operand l_begin = opd_label("begin", g->c->label_seq++);
+  Operand l_end = opd_label("end", g->c->label_seq++);
+  // Generate the code for the condition clause guarding the loop.
+  const NodeId cond = g->ast->lhs[node];
   if (cond) {
-    gen(cond);
-  }
-  printf("  pop rax\n");
-  printf("  cmp rax, 0\n");
-  printf("  je .L.end.%d\n", label_seq);
-  rest = rest->rhs;
-  const Node * const post = rest->lhs;
-  const Node * const body = rest->rhs;
+    gen_branch(g, cond, false, l_end);
+  }
+  insn1(g, IN_LABEL, l_begin);
+  const NodeId post = g->ast->val[node];
+  const NodeId body = g->ast->rhs[node];
   // Generate the code fo the body of the for statement.
-  gen(body);
+  gen_stmt(g, body, false);
   if (post) {
     // Generate the code for the post processing clause.
-    gen(post);
+    gen_expr(g, post);
+    pop_reg(g);
+  }
+  // Generate the code for the condition clause again to repeat the loop.
+  if (cond) {
+    gen_branch(g, cond, true, l_begin);
+  } else {
+    insn1(g, IN_JMP, l_begin);
   }
-  printf("  jmp .L.begin.%d\n", label_seq);
-  printf(".L.end.%d:\n", label_seq);
-  label_seq++;
+  insn1(g, IN_LABEL, l_end);
 }
 
 /*
- * Generates a series of assembly code for the block.
+ * Generates a series of assembly code for the block. The last statement is in
+ * the tail position if the block is.
  */
-static void gen_block(const Node *node) {
-  if (node->kind != ND_BLOCK) {
-    error_at(token->str, "Not a block.");
+static void gen_block(Gen *g, NodeId node, bool tail) {
+  if (g->ast->kind[node] != ND_BLOCK) {
+    error_at(g->c, g->c->token->str, "Not a block.");
   }
 
-  const Node *cur = node->next;
+  NodeId cur = g->ast->lhs[node];
   while (cur) {
-    gen(cur);
-    if (cur->kind != ND_RETURN) {
-      printf("  pop rax\n");
+    gen_stmt(g, cur, tail && !g->ast->next[cur]);
+    cur = g->ast->next[cur];
+  }
+}
+
+/*
+ * Examines if the expression contains an assignment.
+ */
+static bool has_assign(Gen *g, NodeId node) {
+  switch (g->ast->kind[node]) {
+    case ND_ASSIGN:
+      return true;
+    case ND_NUM:
+    case ND_LVAR:
+      return false;
+    case ND_FUNCALL:
+      for (NodeId arg = g->ast->lhs[node]; arg; arg = g->ast->next[arg]) {
+        if (has_assign(g, arg)) {
+          return true;
+        }
+      }
+      return false;
+    default:
+      return has_assign(g, g->ast->lhs[node]) ||
+          has_assign(g, g->ast->rhs[node]);
+  }
+}
+
+/*
+ * Returns the operand of the argument which is passed without evaluating it
+ * into a temporary, or the operand of OPD_NONE. The local variables are read
+ * directly only if no argument assigns to a variable, which may be evaluated
+ * after them.
+ */
+static Operand direct_arg(Gen *g, NodeId arg, bool assigns) {
+  if (g->ast->kind[arg] == ND_NUM) {
+    return opd_imm(g->ast->val[arg]);
+  }
+  if (g->ast->kind[arg] == ND_LVAR && !assigns) {
+    return opd_mem(RBP, -g->vars[g->ast->val[arg]]->offset);
+  }
+
+  return (Operand){};
+}
+
+/*
+ * Generates a series of assembly code that moves the sources to the argument
+ * registers at once. Each move waits until the other sources stop reading
+ * its destination, and the cycle of the moves is broken through RAX.
+ */
+static void gen_arg_moves(Gen *g, Reg *srcs, bool *pending, int n) {
+  for (;;) {
+    int blocked = -1;
+    bool moved = false;
+    for (int i = 0; i < n; i++) {
+      if (!pending[i]) {
+        continue;
+      }
+      bool read = false;
+      for (int j = 0; j < n; j++) {
+        if (j != i && pending[j] && srcs[j] == arg_regs[i]) {
+          read = true;
+        }
+      }
+      if (read) {
+        blocked = i;
+        continue;
+      }
+      insn2(g, IN_MOV, opd_reg(arg_regs[i]), opd_reg(srcs[i]));
+      pending[i] = false;
+      moved = true;
+    }
+
+    if (moved) {
+      continue;
+    }
+    if (blocked < 0) {
+      return;
+    }
+    // Every pending destination is read by another move. Save one of them.
+    insn2(g, IN_MOV, opd_reg(RAX), opd_reg(arg_regs[blocked]));
+    for (int j = 0; j < n; j++) {
+      if (pending[j] && srcs[j] == arg_regs[blocked]) {
+        srcs[j] = RAX;
+      }
     }
-    cur = cur->next;
   }
 }
 
 /*
- * Generates a series of assembly code for the function call.
+ * Generates a series of assembly code that passes the arguments of the
+ * function call as System V ABI does. No temporaries must be live. Returns
+ * the number of the bytes pushed onto the stack, which the caller releases
+ * after the call.
+ *
+ * The arguments beyond the sixth are pushed from the last one after the
+ * padding that aligns RSP to 16 bytes at the call. The others are evaluated
+ * into the temporaries, which are moved to the argument registers at once,
+ * and then the constants and the variables are loaded into their registers
+ * directly.
  */
-static void gen_funcall(const Node *node) {
-  if (node->kind != ND_FUNCALL) {
-    error_at(token->str, "Not a function call.");
+static int gen_args(Gen *g, NodeId node) {
+  int nargs = g->ast->rhs[node];
+  NodeId *args = arena_alloc(g->c, MEM_OTHER, sizeof(NodeId) * (nargs + 1));
+  int n = 0;
+  for (NodeId arg = g->ast->lhs[node]; arg; arg = g->ast->next[arg]) {
+    args[n++] = arg;
+  }
+  bool assigns = has_assign(g, node);
+
+  int nstack = nargs > NUM_ARG_REGS ? nargs - NUM_ARG_REGS : 0;
+  int pushed = 0;
+  if ((g->depth + nstack) % 2) {
+    insn2(g, IN_SUB, opd_reg(RSP), opd_imm(8));
+    g->depth++;
+    pushed++;
+  }
+  for (int i = nargs - 1; i >= NUM_ARG_REGS; i--) {
+    Operand opd = direct_arg(g, args[i], assigns);
+    if (opd.kind != OPD_NONE) {
+      push(g, opd);
+    } else {
+      gen_expr(g, args[i]);
+      push(g, reg(g->top - 1));
+      pop_reg(g);
+    }
+    pushed++;
   }
 
-  const Node *arg = node->lhs;
-  int argn = 0;
-  while (arg) {
-    if (argn > 5) {
-      fprintf(stderr, "More than six arguments are not supported yet.\n");
-      exit(-1);
+  // At most six temporaries are live, which never spill.
+  int nregs = nargs < NUM_ARG_REGS ? nargs : NUM_ARG_REGS;
+  Reg srcs[NUM_ARG_REGS];
+  bool pending[NUM_ARG_REGS];
+  for (int i = 0; i < nregs; i++) {
+    pending[i] = direct_arg(g, args[i], assigns).kind == OPD_NONE;
+    if (pending[i]) {
+      gen_expr(g, args[i]);
+      srcs[i] = reg(g->top - 1).reg;
+    }
+  }
+  gen_arg_moves(g, srcs, pending, nregs);
+  for (int i = 0; i < nregs; i++) {
+    Operand opd = direct_arg(g, args[i], assigns);
+    if (opd.kind != OPD_NONE) {
+      insn2(g, IN_MOV, opd_reg(arg_regs[i]), opd);
     }
-    // Generate the code for the argument.
-    gen(arg->lhs);
-    arg = arg->rhs;
-    argn++;
+  }
+  g->top = 0;
+
+  return pushed * 8;
+}
+
+/*
+ * Generates a series of assembly code for the function call.
+ */
+static void gen_funcall(Gen *g, NodeId node) {
+  if (g->ast->kind[node] != ND_FUNCALL) {
+    error_at(g->c, g->c->token->str, "Not a function call.");
+  }
+
+  // The temporaries are held in the caller-saved registers. Save the ones
+  // which are live in the registers and evaluate the arguments from scratch.
+  int base = g->top;
+  int live = g->top < NUM_TMP_REGS ? g->top : NUM_TMP_REGS;
+  for (int i = base - live; i < base; i++) {
+    push(g, reg(i));
+  }
+  g->top = 0;
+
+  int size = gen_args(g, node);
+  insn1(g, IN_CALL, opd_sym(g->ast->callees[g->ast->val[node]]));
+  if (size) {
+    insn2(g, IN_ADD, opd_reg(RSP), opd_imm(size));
+    g->depth -= size / 8;
   }
 
-  for (int i = 0; i < argn; i++) {
-    printf("  pop %s\n", arg_regs[i]);
+  // Restore the saved temporaries and hold the return value on RAX.
+  for (int i = base - 1; i >= base - live; i--) {
+    pop(g, reg(i));
   }
-  printf("  call %s\n", node->name);
-  // Push the return value of the function on RAX.
-  printf("  push rax\n");
+  g->top = base;
+  insn2(g, IN_MOV, push_reg(g), opd_reg(RAX));
 }
 
 /*
- * Generate a series of assembly code that emulates stack machine from the AST
+ * Generate a series of assembly code that computes the value of the
+ * expression into a newly allocated temporary register.
  *
+ * @param g    the state of the code generation
  * @param node the node from which the assembly code is generated
  */
-static void gen(const Node *node) {
+static void gen_expr(Gen *g, NodeId node) {
   // Handle terminal and assignment nodes.
-  switch (node->kind) {
+  switch (g->ast->kind[node]) {
     case ND_NUM:
-      printf("  push %d\n", node->val);
+      insn2(g, IN_MOV, push_reg(g), opd_imm(g->ast->val[node]));
       return;
     case ND_LVAR:
-      gen_lval(node);
-      printf("  pop rax\n");
-      printf("  mov rax, [rax]\n");
-      printf("  push rax\n");
-
+      insn2(g, IN_MOV, push_reg(g), opd_mem(RBP, -gen_lval(g, node)));
       return;
-    case ND_ASSIGN:
-      gen_lval(node->lhs);
-      gen(node->rhs);
-
-      printf("  pop rdi\n");
-      printf("  pop rax\n");
-      printf("  mov [rax], rdi\n");
-      printf("  push rdi\n");
-
-      return;
-    case ND_IF:
-      gen_if(node);
-      return;
-    case ND_WHILE:
-      gen_while(node);
-      return;
-    case ND_FOR:
-      gen_for(node);
-      return;
-    case ND_BLOCK:
-      gen_block(node);
+    case ND_ASSIGN: {
+      int offset = gen_lval(g, g->ast->lhs[node]);
+      gen_expr(g, g->ast->rhs[node]);
+      insn2(g, IN_MOV, opd_mem(RBP, -offset), reg(g->top - 1));
       return;
+    }
     case ND_FUNCALL:
-      gen_funcall(node);
-      return;
-    case ND_RETURN:
-      gen(node->lhs);
-      printf("  pop rax\n");
-      printf("  mov rsp, rbp\n");
-      printf("  pop rbp\n");
-      printf("  ret\n");
+      gen_funcall(g, node);
       return;
+    case ND_MUL:
+    case ND_DIV: {
+      // Reduce the multiplication and the division by the constant to the
+      // cheaper instructions. The optimizer has put the constant on the rhs.
+      NodeId rhs = g->ast->rhs[node];
+      if (g->ast->kind[rhs] == ND_NUM &&
+          (g->ast->kind[node] == ND_MUL || g->ast->val[rhs])) {
+        gen_expr(g, g->ast->lhs[node]);
+        Reg r = reg(g->top - 1).reg;
+        if (g->ast->kind[node] == ND_MUL) {
+          add_mul_imm(g->c, g->out, r, g->ast->val[rhs]);
+        } else {
+          add_div_imm(g->c, g->out, r, g->ast->val[rhs]);
+        }
+        return;
+      }
+      break;
+    }
   }
 
-  gen(node->lhs);
-  gen(node->rhs);
+  gen_expr(g, g->ast->lhs[node]);
+  gen_expr(g, g->ast->rhs[node]);
 
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+  Operand rd = reg(g->top - 2);
+  Operand rs = reg(g->top - 1);
 
-  switch (node->kind) {
+  switch (g->ast->kind[node]) {
     case ND_ADD:
-      printf("  add rax, rdi\n");
+      insn2(g, IN_ADD, rd, rs);
       break;
     case ND_SUB:
-      printf("  sub rax, rdi\n");
+      insn2(g, IN_SUB, rd, rs);
       break;
     case ND_MUL:
-      printf("  imul rax, rdi\n");
+      insn2(g, IN_IMUL, rd, rs);
       break;
     case ND_DIV:
       // Intel's idiv operation concatenates RDX and RAX, regards them as a
@@ -224,8 +511,10 @@ static void gen(const Node *node) {
       // to RAX and set its remainder to RDX.
       // cqo operation expand the 64bit RAX value to 128bit and set it to
       // RDX and RAX.
-      printf("  cqo\n");
-      printf("  idiv rdi\n");
+      insn2(g, IN_MOV, opd_reg(RAX), rd);
+      insn0(g, IN_CQO);
+      insn1(g, IN_IDIV, rs);
+      insn2(g, IN_MOV, rd, opd_reg(RAX));
       break;
     case ND_EQ:
       // sete sets the result of cmp to the register given as its operand.
@@ -233,70 +522,139 @@ static void gen(const Node *node) {
       // it sets to 0 to the register. AL is an alias for the lower 8bit of
       // RAX and the upper 58bit is preserved in sete. movzb clears the upper
       // 58bit up with zeros.
-      printf("  cmp rax, rdi\n");
-      printf("  sete al\n");
-      printf("  movzb rax, al\n");
+      insn2(g, IN_CMP, rd, rs);
+      insn1(g, IN_SETE, opd_reg8(RAX));
+      insn2(g, IN_MOVZB, rd, opd_reg8(RAX));
       break;
     case ND_NE:
-      printf("  cmp rax, rdi\n");
-      printf("  setne al\n");
-      printf("  movzb rax, al\n");
+      insn2(g, IN_CMP, rd, rs);
+      insn1(g, IN_SETNE, opd_reg8(RAX));
+      insn2(g, IN_MOVZB, rd, opd_reg8(RAX));
       break;
     case ND_LT:
-      printf("  cmp rax, rdi\n");
-      printf("  setl al\n");
-      printf("  movzb rax, al\n");
+      insn2(g, IN_CMP, rd, rs);
+      insn1(g, IN_SETL, opd_reg8(RAX));
+      insn2(g, IN_MOVZB, rd, opd_reg8(RAX));
       break;
     case ND_LE:
-      printf("  cmp rax, rdi\n");
-      printf("  setle al\n");
-      printf("  movzb rax, al\n");
+      insn2(g, IN_CMP, rd, rs);
+      insn1(g, IN_SETLE, opd_reg8(RAX));
+      insn2(g, IN_MOVZB, rd, opd_reg8(RAX));
       break;
+    default:
+      error_at(g->c, g->c->token->str, "Not an expression.");
   }
 
-  printf("  push rax\n");
+  pop_reg(g);
 }
 
 /*
- * Generate prologue of the function and output it to stdout.
+ * Generate a series of assembly code for the statement. The value of the
+ * expression statement in the tail position, after which the program ends,
+ * is returned from the function like in the IR and the VM.
+ *
+ * @param g    the state of the code generation
+ * @param node the node from which the assembly code is generated
+ * @param tail true if the statement is in the tail position
  */
-static void gen_prologue(const Function *program) {
-  printf("  push rbp\n");
-  printf("  mov rbp, rsp\n");
-  printf("  sub rsp, %d\n", program->stack_size);
+static void gen_stmt(Gen *g, NodeId node, bool tail) {
+  switch (g->ast->kind[node]) {
+    case ND_IF:
+      gen_if(g, node, tail);
+      return;
+    case ND_WHILE:
+      gen_while(g, node);
+      return;
+    case ND_FOR:
+      gen_for(g, node);
+      return;
+    case ND_BLOCK:
+      gen_block(g, node, tail);
+      return;
+    case ND_RETURN:
+      if (g->ast->kind[g->ast->lhs[node]] == ND_FUNCALL &&
+          g->ast->rhs[g->ast->lhs[node]] <= NUM_ARG_REGS) {
+        // Tail call: tear down the frame and jump to the callee, which
+        // returns to the caller directly. The arguments on the stack would
+        // be released with the frame.
+        NodeId call = g->ast->lhs[node];
+        gen_args(g, call);
+        gen_leave(g);
+        insn1(g, IN_JMP, opd_sym(g->ast->callees[g->ast->val[call]]));
+        return;
+      }
+      gen_expr(g, g->ast->lhs[node]);
+      insn2(g, IN_MOV, opd_reg(RAX), reg(g->top - 1));
+      pop_reg(g);
+      gen_epilogue(g);
+      return;
+  }
+
+  gen_expr(g, node);
+  if (tail) {
+    insn2(g, IN_MOV, opd_reg(RAX), reg(g->top - 1));
+    pop_reg(g);
+    gen_epilogue(g);
+    return;
+  }
+  pop_reg(g);
 }
 
 /*
- * Generate epilogue of the function and output it to stdout.
+ * Generate prologue of the function.
  */
-static void gen_epilogue() {
-  printf("  mov rsp, rbp\n");
-  printf("  pop rbp\n");
-  printf("  ret\n");
+static void gen_prologue(Gen *g, const Function *program) {
+  insn1(g, IN_PUSH, opd_reg(RBP));
+  insn2(g, IN_MOV, opd_reg(RBP), opd_reg(RSP));
+  // Keep RSP aligned to 16 bytes at the calls.
+  insn2(g, IN_SUB, opd_reg(RSP), opd_imm((program->stack_size + 15) / 16 * 16));
+}
+
+/*
+ * Generate the code tearing down the stack frame of the function.
+ */
+static void gen_leave(Gen *g) {
+  insn2(g, IN_MOV, opd_reg(RSP), opd_reg(RBP));
+  insn1(g, IN_POP, opd_reg(RBP));
+}
+
+/*
+ * Generate epilogue of the function.
+ */
+static void gen_epilogue(Gen *g) {
+  gen_leave(g);
+  insn0(g, IN_RET);
 }
 
 /**
- * Generate a complete assembly code that emulates stack machine from the AST
- * and output it to stdout.
+ * Generate the machine instructions from the AST. The temporary values are
+ * allocated to the registers and spilled to the stack only when they run out.
  *
- * @param program the function from which the assembly code is generated
+ * @param c       the context of the compilation
+ * @param program the function from which the instructions are generated
+ * @return the generated instructions
  */
-void codegen(const Function *program) {
-  printf(".intel_syntax noprefix\n");
-  printf(".global main\n");
-  printf("main:\n");
+InsnList *codegen(Context *c, const Function *program) {
+  Gen gen = {
+    .c = c,
+    .out = arena_alloc(c, MEM_INSN, sizeof(InsnList)),
+    .ast = program->ast,
+    .vars = program->vars,
+  };
+  Gen *g = &gen;
 
-  gen_prologue(program);
+  gen_prologue(g, program);
 
-  Node *cur = program->node;
+  NodeId cur = program->node;
   while (cur) {
-    // Generate a seris of assembly code descending the AST nodes.
-    gen(cur);
-
-    // Pop the top of the stack and load it to RAX.
-    printf("  pop rax\n");
-    cur = cur->next;
+    // Generate a seris of instructions descending the AST nodes.
+    gen_stmt(g, cur, !g->ast->next[cur]);
+    cur = g->ast->next[cur];
   }
 
-  gen_epilogue();
+  // Return 0 when the program falls off the end without a value.
+  insn2(g, IN_MOV, opd_reg(RAX), opd_imm(0));
+  gen_epilogue(g);
+
+  return g->out;
 }
@@ -0,0 +1,32 @@
+#include "pcc.h"
+
+/**
+ * Creates the context of a new compilation.
+ *
+ * @param input_path the path to the input file, "-" for the standard input
+ * @param user_input the whole input, which must outlive the context
+ * @return the created context
+ */
+Context *context_new(const char *input_path, char *user_input) {
+  Context *c = calloc(1, sizeof(Context));
+  if (!c) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  c->input_path = input_path;
+  c->user_input = user_input;
+
+  return c;
+}
+
+/**
+ * Releases the context. The objects in its arena must have been released by
+ * arena_free() beforehand.
+ *
+ * @param c the context to be released
+ */
+void context_free(Context *c) {
+  free(c->out_buf);
+  free(c);
+}
+
@@ -0,0 +1,219 @@
+#include "pcc.h"
+
+#include <elf.h>
+#include <stdint.h>
+
+/*
+ * The sections of the object file in the order of the section headers
+ */
+enum {
+  SEC_NULL,
+  SEC_TEXT,
+  SEC_RELA_TEXT,
+  SEC_SYMTAB,
+  SEC_STRTAB,
+  SEC_SHSTRTAB,
+  SEC_NOTE_STACK,
+  NUM_SECTIONS,
+};
+
+// The section names concatenated in .shstrtab. The offsets of the names are
+// given by sh_names.
+static const char shstrtab[] =
+    "\0.text\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+
+static const int sh_names[] = {
+  [SEC_NULL] = 0, [SEC_TEXT] = 1, [SEC_RELA_TEXT] = 7, [SEC_SYMTAB] = 18,
+  [SEC_STRTAB] = 26, [SEC_SHSTRTAB] = 34, [SEC_NOTE_STACK] = 44,
+};
+
+/*
+ * The growable byte buffer for the string table
+ */
+typedef struct {
+  char *data;
+  int len;
+  int cap;
+} StrTab;
+
+/*
+ * Appends the null-terminated string to the string table and returns its
+ * offset.
+ */
+static int add_str(Context *c, StrTab *tab, const char *s) {
+  int len = strlen(s) + 1;
+  if (tab->len + len > tab->cap) {
+    int cap = tab->cap ? tab->cap * 2 : 256;
+    while (cap < tab->len + len) {
+      cap *= 2;
+    }
+    char *data = arena_alloc(c, MEM_OTHER, cap);
+    if (tab->len) {
+      memcpy(data, tab->data, tab->len);
+    }
+    tab->data = data;
+    tab->cap = cap;
+  }
+
+  int offset = tab->len;
+  memcpy(tab->data + offset, s, len);
+  tab->len += len;
+
+  return offset;
+}
+
+/*
+ * Returns the offset aligned up to 8 bytes.
+ */
+static long align8(long offset) {
+  return (offset + 7) & ~7L;
+}
+
+/*
+ * Pads the output with zeros up to the offset.
+ */
+static void pad_to(Context *c, long *pos, long offset) {
+  static const char zeros[8];
+  emit_bytes(c, zeros, offset - *pos);
+  *pos = offset;
+}
+
+/**
+ * Writes the machine code as the ELF64 relocatable object into the output
+ * buffer. The code is placed in .text as the global function "main" and the
+ * external functions are referenced through the undefined symbols.
+ *
+ * @param c  the context of the compilation
+ * @param mc the machine code to be written
+ */
+void emit_elf(Context *c, const MachineCode *mc) {
+  // The symbol table has the null symbol, main and an undefined symbol for
+  // each external function in the order of the first reference.
+  Elf64_Sym *syms = arena_alloc(c, MEM_OTHER,
+                                sizeof(Elf64_Sym) * (mc->num_relocs + 2));
+  int num_syms = 0;
+  StrTab strtab = {};
+  add_str(c, &strtab, "");
+  syms[num_syms++] = (Elf64_Sym){};
+  syms[num_syms++] = (Elf64_Sym){
+    .st_name = add_str(c, &strtab, "main"),
+    .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC),
+    .st_shndx = SEC_TEXT,
+    .st_size = mc->len,
+  };
+
+  HashMap sym_map = {};
+  Elf64_Rela *relas = arena_alloc(c, MEM_OTHER,
+                                  sizeof(Elf64_Rela) * (mc->num_relocs + 1));
+  for (int i = 0; i < mc->num_relocs; i++) {
+    const Reloc *reloc = &mc->relocs[i];
+    int len = strlen(reloc->name);
+    intptr_t sym = (intptr_t)hashmap_get(&sym_map, reloc->name, len);
+    if (!sym) {
+      sym = num_syms;
+      syms[num_syms++] = (Elf64_Sym){
+        .st_name = add_str(c, &strtab, reloc->name),
+        .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE),
+        .st_shndx = SHN_UNDEF,
+      };
+      hashmap_put(c, &sym_map, reloc->name, len, (void *)sym);
+    }
+    // The displacement is relative to the end of the 32bit field.
+    relas[i] = (Elf64_Rela){
+      .r_offset = reloc->offset,
+      .r_info = ELF64_R_INFO(sym, R_X86_64_PLT32),
+      .r_addend = -4,
+    };
+  }
+
+  // Lay out the sections after the ELF header.
+  long text_off = sizeof(Elf64_Ehdr);
+  long rela_off = align8(text_off + mc->len);
+  long rela_size = sizeof(Elf64_Rela) * mc->num_relocs;
+  long symtab_off = align8(rela_off + rela_size);
+  long symtab_size = sizeof(Elf64_Sym) * num_syms;
+  long strtab_off = symtab_off + symtab_size;
+  long shstrtab_off = strtab_off + strtab.len;
+  long shdr_off = align8(shstrtab_off + sizeof(shstrtab));
+
+  Elf64_Shdr shdrs[NUM_SECTIONS] = {};
+  shdrs[SEC_TEXT] = (Elf64_Shdr){
+    .sh_type = SHT_PROGBITS,
+    .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+    .sh_offset = text_off,
+    .sh_size = mc->len,
+    .sh_addralign = 16,
+  };
+  shdrs[SEC_RELA_TEXT] = (Elf64_Shdr){
+    .sh_type = SHT_RELA,
+    .sh_flags = SHF_INFO_LINK,
+    .sh_offset = rela_off,
+    .sh_size = rela_size,
+    .sh_link = SEC_SYMTAB,
+    .sh_info = SEC_TEXT,
+    .sh_addralign = 8,
+    .sh_entsize = sizeof(Elf64_Rela),
+  };
+  // Every symbol but the null one is global, so the locals end at 1.
+  shdrs[SEC_SYMTAB] = (Elf64_Shdr){
+    .sh_type = SHT_SYMTAB,
+    .sh_offset = symtab_off,
+    .sh_size = symtab_size,
+    .sh_link = SEC_STRTAB,
+    .sh_info = 1,
+    .sh_addralign = 8,
+    .sh_entsize = sizeof(Elf64_Sym),
+  };
+  shdrs[SEC_STRTAB] = (Elf64_Shdr){
+    .sh_type = SHT_STRTAB,
+    .sh_offset = strtab_off,
+    .sh_size = strtab.len,
+    .sh_addralign = 1,
+  };
+  shdrs[SEC_SHSTRTAB] = (Elf64_Shdr){
+    .sh_type = SHT_STRTAB,
+    .sh_offset = shstrtab_off,
+    .sh_size = sizeof(shstrtab),
+    .sh_addralign = 1,
+  };
+  // The empty .note.GNU-stack marks the stack as non-executable.
+  shdrs[SEC_NOTE_STACK] = (Elf64_Shdr){
+    .sh_type = SHT_PROGBITS,
+    .sh_offset = shdr_off,
+    .sh_addralign = 1,
+  };
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    shdrs[i].sh_name = sh_names[i];
+  }
+
+  Elf64_Ehdr ehdr = {
+    .e_ident = {
+      ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT,
+      ELFOSABI_SYSV,
+    },
+    .e_type = ET_REL,
+    .e_machine = EM_X86_64,
+    .e_version = EV_CURRENT,
+    .e_shoff = shdr_off,
+    .e_ehsize = sizeof(Elf64_Ehdr),
+    .e_shentsize = sizeof(Elf64_Shdr),
+    .e_shnum = NUM_SECTIONS,
+    .e_shstrndx = SEC_SHSTRTAB,
+  };
+
+  long pos = 0;
+  emit_bytes(c, &ehdr, sizeof(ehdr));
+  pos += sizeof(ehdr);
+  emit_bytes(c, mc->code, mc->len);
+  pos += mc->len;
+  pad_to(c, &pos, rela_off);
+  emit_bytes(c, relas, rela_size);
+  pos += rela_size;
+  pad_to(c, &pos, symtab_off);
+  emit_bytes(c, syms, symtab_size);
+  emit_bytes(c, strtab.data, strtab.len);
+  emit_bytes(c, shstrtab, sizeof(shstrtab));
+  pos = shstrtab_off + sizeof(shstrtab);
+  pad_to(c, &pos, shdr_off);
+  emit_bytes(c, shdrs, sizeof(shdrs));
+}
@@ -0,0 +1,169 @@
+#include "pcc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// The initial size of the output buffer.
+#define INIT_BUF_SIZE (64 * 1024)
+
+/*
+ * Makes room for at least n more bytes in the output buffer.
+ */
+static inline void reserve(Context *c, size_t n) {
+  if (c->out_len + n <= c->out_cap) {
+    return;
+  }
+
+  size_t cap = c->out_cap ? c->out_cap : INIT_BUF_SIZE;
+  while (cap < c->out_len + n) {
+    cap *= 2;
+  }
+  c->out_buf = realloc(c->out_buf, cap);
+  if (!c->out_buf) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  c->out_cap = cap;
+}
+
+/*
+ * Appends n bytes of the string to the output buffer. The assembly code is
+ * accumulated to the buffer of the context and written out at once by
+ * emit_write().
+ */
+static inline void put_str(Context *c, const char *s, size_t n) {
+  reserve(c, n);
+  memcpy(c->out_buf + c->out_len, s, n);
+  c->out_len += n;
+}
+
+/*
+ * Appends the decimal representation of the integer to the output buffer.
+ */
+static void put_int(Context *c, long val) {
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  // Negate in unsigned arithmetic so that LONG_MIN doesn't overflow.
+  unsigned long u = val < 0 ? -(unsigned long)val : (unsigned long)val;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (val < 0) {
+    *--p = '-';
+  }
+  put_str(c, p, tmp + sizeof(tmp) - p);
+}
+
+/**
+ * Appends the formatted string to the output buffer.
+ *
+ * Only "%s" for strings, "%d" for ints, "%ld" for longs and "%%" are
+ * supported, which is all the code generator needs. They are expanded without
+ * going through stdio.
+ *
+ * @param c   the context of the compilation
+ * @param fmt the format string
+ * @param ... the parameters to be used for the formatting
+ */
+void emit(Context *c, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+
+  const char *p = fmt;
+  while (*p) {
+    const char *start = p;
+    while (*p && *p != '%') {
+      p++;
+    }
+    put_str(c, start, p - start);
+    if (!*p) {
+      break;
+    }
+
+    switch (*++p) {
+      case 's': {
+        const char *s = va_arg(ap, const char *);
+        put_str(c, s, strlen(s));
+        break;
+      }
+      case 'd':
+        put_int(c, va_arg(ap, int));
+        break;
+      case 'l':
+        p++;
+        put_int(c, va_arg(ap, long));
+        break;
+      case '%':
+        put_str(c, "%", 1);
+        break;
+      default:
+        fprintf(stderr, "Unsupported format: %s\n", fmt);
+        exit(1);
+    }
+    p++;
+  }
+
+  va_end(ap);
+}
+
+/**
+ * Appends the raw bytes to the output buffer.
+ *
+ * @param c the context of the compilation
+ * @param data the bytes to be appended
+ * @param n the number of the bytes
+ */
+void emit_bytes(Context *c, const void *data, size_t n) {
+  put_str(c, data, n);
+}
+
+/**
+ * Returns the number of the bytes in the output buffer of the context.
+ *
+ * @param c the context of the compilation
+ * @return the size of the output written so far
+ */
+size_t emit_size(const Context *c) {
+  return c->out_len;
+}
+
+/**
+ * Writes the whole output buffer of the context to the file at once and
+ * clears the buffer.
+ *
+ * @param c    the context of the compilation
+ * @param path the path to the output file, or NULL or "-" for stdout
+ */
+void emit_write(Context *c, const char *path) {
+  int fd = STDOUT_FILENO;
+  if (path && strcmp(path, "-")) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+  }
+
+  const char *buf = c->out_buf;
+  size_t len = c->out_len;
+  size_t off = 0;
+  while (off < len) {
+    ssize_t n = write(fd, buf + off, len - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Cannot write the output: %s\n", strerror(errno));
+      exit(1);
+    }
+    off += n;
+  }
+
+  if (fd != STDOUT_FILENO) {
+    close(fd);
+  }
+  c->out_len = 0;
+}
@@ -0,0 +1,518 @@
+#include "pcc.h"
+
+// The REX prefix and its bits.
+#define REX   0x40
+#define REX_W 0x08
+#define REX_R 0x04
+#define REX_X 0x02
+#define REX_B 0x01
+
+/*
+ * The state of the encoding of an instruction list
+ */
+typedef struct {
+  // The context of the compilation.
+  Context *c;
+  // The code being encoded.
+  MachineCode *mc;
+  // The offsets of the labels in the code indexed by label ids, or -1.
+  int *label_offsets;
+  // Whether the jumps need the 32bit displacements indexed by the positions in
+  // the instruction list.
+  bool *long_jumps;
+} Encoder;
+
+/*
+ * Reports the instruction that has no encoding and exits.
+ */
+static void unsupported(const Insn *insn) {
+  fprintf(stderr, "Cannot encode the instruction of kind %d.\n", insn->kind);
+  exit(1);
+}
+
+/*
+ * Examines if the value fits in the sign-extended 8bit immediate.
+ */
+static bool is_imm8(long val) {
+  return -128 <= val && val <= 127;
+}
+
+/*
+ * Examines if the value fits in the sign-extended 32bit immediate.
+ */
+static bool is_imm32(long val) {
+  return -2147483648L <= val && val <= 2147483647L;
+}
+
+/*
+ * Appends a byte to the code.
+ */
+static void put8(Encoder *e, int byte) {
+  if (e->mc->len == e->mc->cap) {
+    // The old code is left in the arena like the instruction list.
+    int cap = e->mc->cap ? e->mc->cap * 2 : 1024;
+    unsigned char *code = arena_alloc(e->c, MEM_INSN, cap);
+    if (e->mc->len) {
+      memcpy(code, e->mc->code, e->mc->len);
+    }
+    e->mc->code = code;
+    e->mc->cap = cap;
+  }
+
+  e->mc->code[e->mc->len++] = byte;
+}
+
+/*
+ * Appends the 32bit value to the code in little endian.
+ */
+static void put32(Encoder *e, long val) {
+  for (int i = 0; i < 4; i++) {
+    put8(e, (val >> (i * 8)) & 0xff);
+  }
+}
+
+/*
+ * Appends the 64bit value to the code in little endian.
+ */
+static void put64(Encoder *e, long val) {
+  put32(e, val);
+  put32(e, val >> 32);
+}
+
+/*
+ * Appends the REX prefix if it is needed. The prefix is also forced for the
+ * lower 8bit of RSP, RBP, RSI and RDI, which are AH, CH, DH and BH without it.
+ */
+static void put_rex(Encoder *e, bool w, int reg, const Operand *rm) {
+  int rex = REX;
+  if (w) {
+    rex |= REX_W;
+  }
+  if (reg & 8) {
+    rex |= REX_R;
+  }
+  if (rm->reg & 8) {
+    rex |= REX_B;
+  }
+  if (rm->kind == OPD_MEM && rm->scale && (rm->index & 8)) {
+    rex |= REX_X;
+  }
+  if (rex != REX || (rm->kind == OPD_REG8 && rm->reg >= RSP)) {
+    put8(e, rex);
+  }
+}
+
+/*
+ * Appends the ModR/M byte and the displacement for the register or the
+ * memory operand rm. reg is the register or the opcode extension placed in
+ * the reg field.
+ */
+static void put_modrm(Encoder *e, int reg, const Operand *rm) {
+  int base = rm->reg & 7;
+
+  if (rm->kind == OPD_REG || rm->kind == OPD_REG8) {
+    put8(e, 0xc0 | (reg & 7) << 3 | base);
+    return;
+  }
+  if (rm->kind != OPD_MEM) {
+    fprintf(stderr, "Not a register or memory operand.\n");
+    exit(1);
+  }
+
+  // RBP and R13 as the base need the displacement, even if it is zero.
+  int mod = 2;
+  if (rm->imm == 0 && base != RBP) {
+    mod = 0;
+  } else if (is_imm8(rm->imm)) {
+    mod = 1;
+  }
+  if (rm->scale) {
+    // The SIB byte follows the ModR/M byte with RSP in its r/m field.
+    static const int scale_bits[] = {[1] = 0, [2] = 1, [4] = 2, [8] = 3};
+    put8(e, mod << 6 | (reg & 7) << 3 | RSP);
+    put8(e, scale_bits[rm->scale] << 6 | (rm->index & 7) << 3 | base);
+  } else {
+    put8(e, mod << 6 | (reg & 7) << 3 | base);
+    // RSP and R12 as the base need the SIB byte without the index.
+    if (base == RSP) {
+      put8(e, 0x24);
+    }
+  }
+  if (mod == 1) {
+    put8(e, rm->imm & 0xff);
+  } else if (mod == 2) {
+    put32(e, rm->imm);
+  }
+}
+
+/*
+ * Appends the instruction with the ModR/M operand. n bytes of the opcode are
+ * put between the prefix and the ModR/M byte.
+ */
+static void put_op(Encoder *e, bool w, const char *opcode, int n, int reg,
+                   const Operand *rm) {
+  put_rex(e, w, reg, rm);
+  for (int i = 0; i < n; i++) {
+    put8(e, (unsigned char)opcode[i]);
+  }
+  put_modrm(e, reg, rm);
+}
+
+/*
+ * Appends the jump to the label. cc is the condition code of the conditional
+ * jump or -1 for jmp. The displacement is relative to the end of the jump.
+ */
+static void put_jump(Encoder *e, int cc, const Operand *label, bool is_long) {
+  int target = e->label_offsets[label->imm];
+
+  if (!is_long) {
+    put8(e, cc < 0 ? 0xeb : 0x70 + cc);
+    put8(e, (target - (e->mc->len + 1)) & 0xff);
+    return;
+  }
+
+  if (cc < 0) {
+    put8(e, 0xe9);
+  } else {
+    put8(e, 0x0f);
+    put8(e, 0x80 + cc);
+  }
+  put32(e, target - (e->mc->len + 4));
+}
+
+/*
+ * Appends the 32bit displacement to the external symbol as the relocation.
+ */
+static void put_sym(Encoder *e, const Operand *sym) {
+  if (e->mc->num_relocs == e->mc->cap_relocs) {
+    int cap = e->mc->cap_relocs ? e->mc->cap_relocs * 2 : 16;
+    Reloc *relocs = arena_alloc(e->c, MEM_INSN, sizeof(Reloc) * cap);
+    if (e->mc->num_relocs) {
+      memcpy(relocs, e->mc->relocs, sizeof(Reloc) * e->mc->num_relocs);
+    }
+    e->mc->relocs = relocs;
+    e->mc->cap_relocs = cap;
+  }
+
+  e->mc->relocs[e->mc->num_relocs++] = (Reloc){ .offset = e->mc->len,
+                                          .name = sym->name };
+  put32(e, 0);
+}
+
+/*
+ * Appends the two-operand arithmetic instruction, add, sub or cmp. op is the
+ * opcode of the "r/m, reg" form, which is followed by the "reg, r/m" form,
+ * and ext is the opcode extension of the immediate forms.
+ */
+static void put_alu(Encoder *e, const Insn *insn, int op, int ext) {
+  const Operand *dst = &insn->dst;
+  const Operand *src = &insn->src;
+  char opcode = op;
+
+  switch (src->kind) {
+    case OPD_IMM:
+      if (!is_imm32(src->imm)) {
+        break;
+      }
+      if (is_imm8(src->imm)) {
+        put_op(e, true, "\x83", 1, ext, dst);
+        put8(e, src->imm & 0xff);
+      } else {
+        put_op(e, true, "\x81", 1, ext, dst);
+        put32(e, src->imm);
+      }
+      return;
+    case OPD_REG:
+      put_op(e, true, &opcode, 1, src->reg, dst);
+      return;
+    case OPD_MEM:
+      if (dst->kind == OPD_REG) {
+        opcode = op + 2;
+        put_op(e, true, &opcode, 1, dst->reg, src);
+        return;
+      }
+      break;
+  }
+
+  unsupported(insn);
+}
+
+/*
+ * Appends the shift of the register or the memory by the immediate. ext is the
+ * opcode extension of the shift. The shift by 1 has its own shorter form.
+ */
+static void put_shift(Encoder *e, const Insn *insn, int ext) {
+  if (insn->src.kind != OPD_IMM) {
+    unsupported(insn);
+  }
+
+  if (insn->src.imm == 1) {
+    put_op(e, true, "\xd1", 1, ext, &insn->dst);
+  } else {
+    put_op(e, true, "\xc1", 1, ext, &insn->dst);
+    put8(e, insn->src.imm & 0xff);
+  }
+}
+
+/*
+ * Appends the machine code of the i-th instruction.
+ */
+static void encode_insn(Encoder *e, const Insn *insn, int i) {
+  const Operand *dst = &insn->dst;
+  const Operand *src = &insn->src;
+
+  switch (insn->kind) {
+    case IN_NOP:
+      return;
+    case IN_LABEL:
+      e->label_offsets[dst->imm] = e->mc->len;
+      return;
+    case IN_MOV:
+      if (src->kind == OPD_IMM) {
+        if (dst->kind == OPD_REG && !is_imm32(src->imm)) {
+          // movabs
+          put_rex(e, true, 0, dst);
+          put8(e, 0xb8 + (dst->reg & 7));
+          put64(e, src->imm);
+        } else if (is_imm32(src->imm)) {
+          put_op(e, true, "\xc7", 1, 0, dst);
+          put32(e, src->imm);
+        } else {
+          break;
+        }
+        return;
+      }
+      if (src->kind == OPD_REG) {
+        put_op(e, true, "\x89", 1, src->reg, dst);
+        return;
+      }
+      if (src->kind == OPD_MEM && dst->kind == OPD_REG) {
+        put_op(e, true, "\x8b", 1, dst->reg, src);
+        return;
+      }
+      break;
+    case IN_MOVZB:
+      put_op(e, true, "\x0f\xb6", 2, dst->reg, src);
+      return;
+    case IN_LEA:
+      if (dst->kind != OPD_REG || src->kind != OPD_MEM) {
+        break;
+      }
+      put_op(e, true, "\x8d", 1, dst->reg, src);
+      return;
+    case IN_PUSH:
+      switch (dst->kind) {
+        case OPD_REG:
+          if (dst->reg & 8) {
+            put8(e, REX | REX_B);
+          }
+          put8(e, 0x50 + (dst->reg & 7));
+          return;
+        case OPD_IMM:
+          if (is_imm8(dst->imm)) {
+            put8(e, 0x6a);
+            put8(e, dst->imm & 0xff);
+          } else {
+            put8(e, 0x68);
+            put32(e, dst->imm);
+          }
+          return;
+        case OPD_MEM:
+          put_op(e, false, "\xff", 1, 6, dst);
+          return;
+      }
+      break;
+    case IN_POP:
+      if (dst->kind == OPD_REG) {
+        if (dst->reg & 8) {
+          put8(e, REX | REX_B);
+        }
+        put8(e, 0x58 + (dst->reg & 7));
+      } else {
+        put_op(e, false, "\x8f", 1, 0, dst);
+      }
+      return;
+    case IN_ADD:
+      put_alu(e, insn, 0x01, 0);
+      return;
+    case IN_SUB:
+      put_alu(e, insn, 0x29, 5);
+      return;
+    case IN_CMP:
+      put_alu(e, insn, 0x39, 7);
+      return;
+    case IN_IMUL:
+      if (dst->kind != OPD_REG) {
+        break;
+      }
+      if (src->kind == OPD_IMM) {
+        // The three-operand form with the destination as the source.
+        if (is_imm8(src->imm)) {
+          put_op(e, true, "\x6b", 1, dst->reg, dst);
+          put8(e, src->imm & 0xff);
+        } else {
+          put_op(e, true, "\x69", 1, dst->reg, dst);
+          put32(e, src->imm);
+        }
+      } else {
+        put_op(e, true, "\x0f\xaf", 2, dst->reg, src);
+      }
+      return;
+    case IN_IMUL1:
+      put_op(e, true, "\xf7", 1, 5, dst);
+      return;
+    case IN_NEG:
+      put_op(e, true, "\xf7", 1, 3, dst);
+      return;
+    case IN_SHL:
+      put_shift(e, insn, 4);
+      return;
+    case IN_SAR:
+      put_shift(e, insn, 7);
+      return;
+    case IN_SHR:
+      put_shift(e, insn, 5);
+      return;
+    case IN_CQO:
+      put8(e, REX | REX_W);
+      put8(e, 0x99);
+      return;
+    case IN_IDIV:
+      put_op(e, true, "\xf7", 1, 7, dst);
+      return;
+    case IN_SETE:
+      put_op(e, false, "\x0f\x94", 2, 0, dst);
+      return;
+    case IN_SETNE:
+      put_op(e, false, "\x0f\x95", 2, 0, dst);
+      return;
+    case IN_SETL:
+      put_op(e, false, "\x0f\x9c", 2, 0, dst);
+      return;
+    case IN_SETLE:
+      put_op(e, false, "\x0f\x9e", 2, 0, dst);
+      return;
+    case IN_JMP:
+      if (dst->kind == OPD_SYM) {
+        // The tail call to the external function.
+        put8(e, 0xe9);
+        put_sym(e, dst);
+        return;
+      }
+      put_jump(e, -1, dst, e->long_jumps[i]);
+      return;
+    case IN_JE:
+      put_jump(e, 0x4, dst, e->long_jumps[i]);
+      return;
+    case IN_JNE:
+      put_jump(e, 0x5, dst, e->long_jumps[i]);
+      return;
+    case IN_JL:
+      put_jump(e, 0xc, dst, e->long_jumps[i]);
+      return;
+    case IN_JGE:
+      put_jump(e, 0xd, dst, e->long_jumps[i]);
+      return;
+    case IN_JLE:
+      put_jump(e, 0xe, dst, e->long_jumps[i]);
+      return;
+    case IN_JG:
+      put_jump(e, 0xf, dst, e->long_jumps[i]);
+      return;
+    case IN_CALL:
+      if (dst->kind != OPD_SYM) {
+        break;
+      }
+      put8(e, 0xe8);
+      put_sym(e, dst);
+      return;
+    case IN_RET:
+      put8(e, 0xc3);
+      return;
+  }
+
+  unsupported(insn);
+}
+
+/**
+ * Encodes the instructions to the x86-64 machine code. The jumps to the
+ * labels are resolved and the calls to the external functions are left as
+ * the relocations.
+ *
+ * The jumps are encoded with the 8bit displacements where the targets are in
+ * range like the assembler does. They start short and the ones whose targets
+ * end up too far are lengthened until every jump fits.
+ *
+ * @param c    the context of the compilation
+ * @param list the instructions to be encoded
+ * @return the encoded machine code
+ */
+MachineCode *encode(Context *c, const InsnList *list) {
+  Encoder encoder = {
+    .c = c,
+    .mc = arena_alloc(c, MEM_INSN, sizeof(MachineCode)),
+  };
+  Encoder *e = &encoder;
+
+  int num_labels = 0;
+  for (int i = 0; i < list->len; i++) {
+    const Insn *insn = &list->insns[i];
+    if (insn->kind == IN_LABEL && insn->dst.imm >= num_labels) {
+      num_labels = insn->dst.imm + 1;
+    }
+  }
+  e->label_offsets = arena_alloc(c, MEM_OTHER, sizeof(int) * (num_labels + 1));
+  memset(e->label_offsets, -1, sizeof(int) * (num_labels + 1));
+  e->long_jumps = arena_alloc(c, MEM_OTHER, sizeof(bool) * (list->len + 1));
+
+  // Measure the instructions with all jumps short.
+  int *sizes = arena_alloc(c, MEM_OTHER, sizeof(int) * (list->len + 1));
+  for (int i = 0; i < list->len; i++) {
+    int start = e->mc->len;
+    encode_insn(e, &list->insns[i], i);
+    sizes[i] = e->mc->len - start;
+  }
+
+  // Lengthen the jumps out of range. The jumps only grow, so the layout
+  // converges.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int offset = 0;
+    for (int i = 0; i < list->len; i++) {
+      if (list->insns[i].kind == IN_LABEL) {
+        e->label_offsets[list->insns[i].dst.imm] = offset;
+      }
+      offset += sizes[i];
+    }
+
+    offset = 0;
+    for (int i = 0; i < list->len; i++) {
+      const Insn *insn = &list->insns[i];
+      offset += sizes[i];
+      if (insn->kind == IN_LABEL || insn->dst.kind != OPD_LABEL) {
+        continue;
+      }
+      int target = insn->dst.imm < num_labels ?
+          e->label_offsets[insn->dst.imm] : -1;
+      if (target < 0) {
+        fprintf(stderr, "Undefined label %ld.\n", insn->dst.imm);
+        exit(1);
+      }
+      if (!e->long_jumps[i] && !is_imm8(target - offset)) {
+        e->long_jumps[i] = true;
+        sizes[i] = insn->kind == IN_JMP ? 5 : 6;
+        changed = true;
+      }
+    }
+  }
+
+  // Encode the instructions in their final forms.
+  e->mc->len = 0;
+  e->mc->num_relocs = 0;
+  for (int i = 0; i < list->len; i++) {
+    encode_insn(e, &list->insns[i], i);
+  }
+
+  return e->mc;
+}
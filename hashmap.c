@@ -0,0 +1,127 @@
+#include "pcc.h"
+
+// The initial number of the buckets. It must be a power of two.
+#define INIT_CAPACITY 16
+
+// The table grows when the load factor exceeds HIGH_WATERMARK percent.
+#define HIGH_WATERMARK 70
+
+/*
+ * Computes the FNV-1a hash of the key.
+ */
+static unsigned int fnv_hash(const char *key, int len) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/*
+ * Finds the bucket for the key with open addressing and linear probing. The
+ * returned bucket is either the one holding the key or the empty one where the
+ * key should be inserted.
+ */
+static HashEntry *find_entry(const HashMap *map, const char *key, int len,
+                             unsigned int hash) {
+  unsigned int mask = map->capacity - 1;
+  for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+    HashEntry *ent = &map->entries[i];
+    if (!ent->key) {
+      return ent;
+    }
+    if (ent->hash == hash && ent->len == len && !memcmp(ent->key, key, len)) {
+      return ent;
+    }
+  }
+}
+
+/*
+ * Doubles the number of the buckets and rehashes the entries.
+ */
+static void rehash(Context *c, HashMap *map) {
+  HashMap grown = {};
+  grown.capacity = map->capacity ? map->capacity * 2 : INIT_CAPACITY;
+  grown.entries =
+      arena_alloc(c, MEM_SYMTAB, sizeof(HashEntry) * grown.capacity);
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->entries[i];
+    if (ent->key) {
+      *find_entry(&grown, ent->key, ent->len, ent->hash) = *ent;
+      grown.used++;
+    }
+  }
+
+  *map = grown;
+}
+
+/**
+ * Looks up the value associated with the key.
+ *
+ * @param map the hash map
+ * @param key the pointer to the key, which doesn't need to be null-terminated
+ * @param len the length of the key
+ * @return the value associated with the key if any, otherwise NULL
+ */
+void *hashmap_get(const HashMap *map, const char *key, int len) {
+  if (!map->entries) {
+    return NULL;
+  }
+
+  HashEntry *ent = find_entry(map, key, len, fnv_hash(key, len));
+
+  return ent->key ? ent->val : NULL;
+}
+
+/**
+ * Associates the value with the key, replacing the existing value if any.
+ *
+ * The map refers to the key without copying it, so it must outlive the map.
+ *
+ * @param c   the context of the compilation
+ * @param map the hash map
+ * @param key the pointer to the key, which doesn't need to be null-terminated
+ * @param len the length of the key
+ * @param val the value to be associated with the key
+ */
+void hashmap_put(Context *c, HashMap *map, const char *key, int len,
+                 void *val) {
+  if ((map->used + 1) * 100 >= map->capacity * HIGH_WATERMARK) {
+    rehash(c, map);
+  }
+
+  unsigned int hash = fnv_hash(key, len);
+  HashEntry *ent = find_entry(map, key, len, hash);
+  if (!ent->key) {
+    ent->key = key;
+    ent->len = len;
+    ent->hash = hash;
+    map->used++;
+  }
+  ent->val = val;
+}
+
+/**
+ * Interns the string.
+ *
+ * The same string is always interned to the same pointer in a compilation,
+ * so the interned strings can be compared by their addresses.
+ *
+ * @param c the context of the compilation
+ * @param s the pointer to the string, which doesn't need to be null-terminated
+ * @param len the length of the string
+ * @return the null-terminated interned string
+ */
+const char *intern(Context *c, const char *s, int len) {
+  // The value of each entry is the interned string itself.
+  const char *name = hashmap_get(&c->names, s, len);
+  if (!name) {
+    name = arena_strndup(c, s, len);
+    hashmap_put(c, &c->names, name, len, (void *)name);
+  }
+
+  return name;
+}
@@ -0,0 +1,179 @@
+#include "pcc.h"
+
+// The names of the 64bit registers indexed by Reg.
+static const char *reg_names[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+// The names of the lower 8bit of the registers indexed by Reg.
+static const char *reg8_names[] = {
+  "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+  "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+// The mnemonics indexed by InsnKind.
+static const char *mnemonics[] = {
+  [IN_MOV] = "mov", [IN_MOVZB] = "movzb", [IN_LEA] = "lea", [IN_PUSH] = "push",
+  [IN_POP] = "pop", [IN_ADD] = "add", [IN_SUB] = "sub", [IN_IMUL] = "imul",
+  [IN_IMUL1] = "imul", [IN_NEG] = "neg", [IN_SHL] = "shl", [IN_SAR] = "sar",
+  [IN_SHR] = "shr", [IN_CQO] = "cqo", [IN_IDIV] = "idiv", [IN_CMP] = "cmp",
+  [IN_SETE] = "sete", [IN_SETNE] = "setne", [IN_SETL] = "setl",
+  [IN_SETLE] = "setle", [IN_JMP] = "jmp", [IN_JE] = "je", [IN_JNE] = "jne",
+  [IN_JL] = "jl", [IN_JLE] = "jle", [IN_JG] = "jg", [IN_JGE] = "jge",
+  [IN_CALL] = "call", [IN_RET] = "ret",
+};
+
+/**
+ * Returns the register operand.
+ */
+Operand opd_reg(Reg reg) {
+  return (Operand){ .kind = OPD_REG, .reg = reg };
+}
+
+/**
+ * Returns the operand for the lower 8bit of the register.
+ */
+Operand opd_reg8(Reg reg) {
+  return (Operand){ .kind = OPD_REG8, .reg = reg };
+}
+
+/**
+ * Returns the immediate operand.
+ */
+Operand opd_imm(long imm) {
+  return (Operand){ .kind = OPD_IMM, .imm = imm };
+}
+
+/**
+ * Returns the memory operand at [base+disp].
+ */
+Operand opd_mem(Reg base, long disp) {
+  return (Operand){ .kind = OPD_MEM, .reg = base, .imm = disp };
+}
+
+/**
+ * Returns the memory operand at [base+index*scale+disp].
+ */
+Operand opd_mem_index(Reg base, Reg index, int scale, long disp) {
+  return (Operand){ .kind = OPD_MEM, .reg = base, .index = index,
+                    .scale = scale, .imm = disp };
+}
+
+/**
+ * Returns the local label operand, which is printed as ".L.<name>.<id>".
+ */
+Operand opd_label(const char *name, int id) {
+  return (Operand){ .kind = OPD_LABEL, .imm = id, .name = name };
+}
+
+/**
+ * Returns the external symbol operand.
+ */
+Operand opd_sym(const char *name) {
+  return (Operand){ .kind = OPD_SYM, .name = name };
+}
+
+/**
+ * Appends the instruction to the list.
+ *
+ * @param c    the context of the compilation
+ * @param list the list of the instructions
+ * @param kind the kind of the instruction
+ * @param dst  the first operand or the operand of OPD_NONE
+ * @param src  the second operand or the operand of OPD_NONE
+ */
+void add_insn(Context *c, InsnList *list, InsnKind kind, Operand dst,
+              Operand src) {
+  if (list->len == list->cap) {
+    // The old array is left in the arena, which is at most as large as the
+    // new one in total.
+    int cap = list->cap ? list->cap * 2 : 256;
+    Insn *insns = arena_alloc(c, MEM_INSN, sizeof(Insn) * cap);
+    if (list->len) {
+      memcpy(insns, list->insns, sizeof(Insn) * list->len);
+    }
+    list->insns = insns;
+    list->cap = cap;
+  }
+
+  list->insns[list->len++] = (Insn){ .kind = kind, .dst = dst, .src = src };
+}
+
+/*
+ * Prints the operand. The size of the memory operand is printed explicitly
+ * when the other operand doesn't determine it.
+ */
+static void emit_operand(Context *c, const Operand *opd, const Operand *other) {
+  switch (opd->kind) {
+    case OPD_NONE:
+      return;
+    case OPD_REG:
+      emit(c, "%s", reg_names[opd->reg]);
+      return;
+    case OPD_REG8:
+      emit(c, "%s", reg8_names[opd->reg]);
+      return;
+    case OPD_IMM:
+      emit(c, "%ld", opd->imm);
+      return;
+    case OPD_MEM:
+      if (!other || (other->kind != OPD_REG && other->kind != OPD_REG8)) {
+        emit(c, "QWORD PTR ");
+      }
+      emit(c, "[%s", reg_names[opd->reg]);
+      if (opd->scale) {
+        emit(c, "+%s*%d", reg_names[opd->index], opd->scale);
+      }
+      if (opd->imm < 0) {
+        emit(c, "%ld]", opd->imm);
+      } else if (opd->imm > 0) {
+        emit(c, "+%ld]", opd->imm);
+      } else {
+        emit(c, "]");
+      }
+      return;
+    case OPD_LABEL:
+      emit(c, ".L.%s.%ld", opd->name, opd->imm);
+      return;
+    case OPD_SYM:
+      emit(c, "%s", opd->name);
+      return;
+  }
+}
+
+/**
+ * Prints the instructions as the assembly code into the output buffer.
+ *
+ * @param c    the context of the compilation
+ * @param list the instructions to be printed
+ */
+void emit_asm(Context *c, const InsnList *list) {
+  emit(c, ".intel_syntax noprefix\n");
+  emit(c, ".global main\n");
+  emit(c, "main:\n");
+
+  for (int i = 0; i < list->len; i++) {
+    const Insn *insn = &list->insns[i];
+    switch (insn->kind) {
+      case IN_NOP:
+        continue;
+      case IN_LABEL:
+        emit_operand(c, &insn->dst, NULL);
+        emit(c, ":\n");
+        continue;
+    }
+
+    emit(c, "  %s", mnemonics[insn->kind]);
+    if (insn->dst.kind != OPD_NONE) {
+      emit(c, " ");
+      emit_operand(c, &insn->dst,
+                   insn->src.kind != OPD_NONE ? &insn->src : NULL);
+    }
+    if (insn->src.kind != OPD_NONE) {
+      emit(c, ", ");
+      emit_operand(c, &insn->src, &insn->dst);
+    }
+    emit(c, "\n");
+  }
+}
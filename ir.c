@@ -0,0 +1,409 @@
+#include "pcc.h"
+
+/*
+ * The state of the lowering of a function
+ */
+typedef struct {
+  Context *c;           // The context of the compilation
+  IrFunc *fn;           // The function being lowered
+  const Ast *ast;       // The AST of the function
+  LVar **vars;          // The local variables of the function
+  BasicBlock *cur_bb;   // The block the instructions are appended to
+  BasicBlock *last_bb;  // The last block in the layout order
+} Lower;
+
+static void lower_stmt(Lower *lo, NodeId node, bool tail);
+static int lower_expr(Lower *lo, NodeId node);
+
+/*
+ * Creates a new basic block. It is not placed in the layout until
+ * start_block() is called with it.
+ */
+static BasicBlock *new_block(Lower *lo) {
+  BasicBlock *bb = arena_alloc(lo->c, MEM_IR, sizeof(BasicBlock));
+  bb->id = lo->fn->num_blocks++;
+
+  return bb;
+}
+
+/*
+ * Places the block at the end of the layout and makes it current.
+ */
+static void start_block(Lower *lo, BasicBlock *bb) {
+  if (lo->last_bb) {
+    lo->last_bb->next = bb;
+  } else {
+    lo->fn->blocks = bb;
+  }
+  lo->last_bb = bb;
+  lo->cur_bb = bb;
+}
+
+/*
+ * Appends a new instruction to the current block.
+ */
+static IrInsn *new_insn(Lower *lo, IrOp op) {
+  IrInsn *insn = arena_alloc(lo->c, MEM_IR, sizeof(IrInsn));
+  insn->op = op;
+
+  if (lo->cur_bb->tail) {
+    lo->cur_bb->tail->next = insn;
+  } else {
+    lo->cur_bb->head = insn;
+  }
+  lo->cur_bb->tail = insn;
+
+  return insn;
+}
+
+/*
+ * Returns a new virtual register.
+ */
+static int new_vreg(Lower *lo) {
+  return ++lo->fn->num_vregs;
+}
+
+/*
+ * Appends the unconditional jump to the target block.
+ */
+static void jmp(Lower *lo, BasicBlock *target) {
+  new_insn(lo, IR_JMP)->then = target;
+}
+
+/*
+ * Appends the conditional branch on the virtual register.
+ */
+static void br(Lower *lo, int cond, BasicBlock *then, BasicBlock *els) {
+  IrInsn *insn = new_insn(lo, IR_BR);
+  insn->a = cond;
+  insn->then = then;
+  insn->els = els;
+}
+
+/*
+ * Appends the return of the virtual register. The following instructions
+ * go to a new unreachable block, which keeps every block ending with a jump.
+ */
+static void ret(Lower *lo, int val) {
+  new_insn(lo, IR_RET)->a = val;
+  start_block(lo, new_block(lo));
+}
+
+/*
+ * Lowers the binary operation.
+ */
+static int lower_binary(Lower *lo, NodeId node) {
+  IrOp op;
+  switch (lo->ast->kind[node]) {
+    case ND_ADD:
+      op = IR_ADD;
+      break;
+    case ND_SUB:
+      op = IR_SUB;
+      break;
+    case ND_MUL:
+      op = IR_MUL;
+      break;
+    case ND_DIV:
+      op = IR_DIV;
+      break;
+    case ND_EQ:
+      op = IR_EQ;
+      break;
+    case ND_NE:
+      op = IR_NE;
+      break;
+    case ND_LT:
+      op = IR_LT;
+      break;
+    case ND_LE:
+      op = IR_LE;
+      break;
+    default:
+      error_at(lo->c, lo->c->token->str, "Not an expression.");
+  }
+
+  NodeId rhs = lo->ast->rhs[node];
+  int a = lower_expr(lo, lo->ast->lhs[node]);
+  // Keep the constant multiplier and divisor in the instruction so that the
+  // code generator can reduce the operation.
+  if ((op == IR_MUL || op == IR_DIV) && lo->ast->kind[rhs] == ND_NUM &&
+      (op == IR_MUL || lo->ast->val[rhs])) {
+    IrInsn *insn = new_insn(lo, op);
+    insn->dst = new_vreg(lo);
+    insn->a = a;
+    insn->imm = lo->ast->val[rhs];
+    return insn->dst;
+  }
+  int b = lower_expr(lo, rhs);
+  IrInsn *insn = new_insn(lo, op);
+  insn->dst = new_vreg(lo);
+  insn->a = a;
+  insn->b = b;
+
+  return insn->dst;
+}
+
+/*
+ * Lowers the function call.
+ */
+static int lower_funcall(Lower *lo, NodeId node) {
+  int nparams = lo->ast->rhs[node];
+  int *args = arena_alloc(lo->c, MEM_IR, sizeof(int) * (nparams ? nparams : 1));
+  int nargs = 0;
+  for (NodeId arg = lo->ast->lhs[node]; arg; arg = lo->ast->next[arg]) {
+    args[nargs++] = lower_expr(lo, arg);
+  }
+
+  IrInsn *insn = new_insn(lo, IR_CALL);
+  insn->dst = new_vreg(lo);
+  insn->name = lo->ast->callees[lo->ast->val[node]];
+  insn->args = args;
+  insn->nargs = nargs;
+
+  return insn->dst;
+}
+
+/*
+ * Lowers the expression and returns the virtual register holding its value.
+ */
+static int lower_expr(Lower *lo, NodeId node) {
+  IrInsn *insn;
+
+  switch (lo->ast->kind[node]) {
+    case ND_NUM:
+      insn = new_insn(lo, IR_IMM);
+      insn->dst = new_vreg(lo);
+      insn->imm = lo->ast->val[node];
+      return insn->dst;
+    case ND_LVAR:
+      insn = new_insn(lo, IR_LOAD);
+      insn->dst = new_vreg(lo);
+      insn->lvar = lo->vars[lo->ast->val[node]];
+      return insn->dst;
+    case ND_ASSIGN: {
+      NodeId lhs = lo->ast->lhs[node];
+      if (lo->ast->kind[lhs] != ND_LVAR) {
+        error_at(lo->c, lo->c->token->str, "The left hand side of the assiment is not left value.");
+      }
+      int val = lower_expr(lo, lo->ast->rhs[node]);
+      insn = new_insn(lo, IR_STORE);
+      insn->a = val;
+      insn->lvar = lo->vars[lo->ast->val[lhs]];
+      return val;
+    }
+    case ND_FUNCALL:
+      return lower_funcall(lo, node);
+    default:
+      return lower_binary(lo, node);
+  }
+}
+
+/*
+ * Lowers the condition and branches to the blocks. The constant condition
+ * jumps to the taken block unconditionally.
+ */
+static void lower_cond(Lower *lo, NodeId cond, BasicBlock *then,
+                       BasicBlock *els) {
+  if (lo->ast->kind[cond] == ND_NUM) {
+    jmp(lo, lo->ast->val[cond] ? then : els);
+    return;
+  }
+  // Branch on the negated comparison the other way.
+  NodeId cmp = negated_cmp(lo->ast, cond);
+  if (cmp) {
+    lower_cond(lo, cmp, els, then);
+    return;
+  }
+  br(lo, lower_expr(lo, cond), then, els);
+}
+
+/*
+ * Lowers the if statement.
+ */
+static void lower_if(Lower *lo, NodeId node, bool tail) {
+  NodeId ebody = lo->ast->val[node];
+  BasicBlock *then = new_block(lo);
+  BasicBlock *els = new_block(lo);
+  BasicBlock *end = ebody ? new_block(lo) : els;
+
+  lower_cond(lo, lo->ast->lhs[node], then, els);
+  start_block(lo, then);
+  lower_stmt(lo, lo->ast->rhs[node], tail);
+  jmp(lo, end);
+  if (ebody) {
+    start_block(lo, els);
+    lower_stmt(lo, ebody, tail);
+    jmp(lo, end);
+  }
+  start_block(lo, end);
+}
+
+/*
+ * Lowers the while statement.
+ *
+ * The loop is rotated: the condition is checked once on entry to skip the
+ * loop and then at the end of the body to repeat it, which lays out the
+ * body to fall through to the check and the check to the exit.
+ */
+static void lower_while(Lower *lo, NodeId node) {
+  BasicBlock *body = new_block(lo);
+  BasicBlock *end = new_block(lo);
+
+  lower_cond(lo, lo->ast->lhs[node], body, end);
+  start_block(lo, body);
+  lower_stmt(lo, lo->ast->rhs[node], false);
+  lower_cond(lo, lo->ast->lhs[node], body, end);
+  start_block(lo, end);
+}
+
+/*
+ * Lowers the for statement. The loop is rotated like the while statement.
+ */
+static void lower_for(Lower *lo, NodeId node) {
+  NodeId cond = lo->ast->lhs[node];
+  NodeId post = lo->ast->val[node];
+  NodeId body = lo->ast->rhs[node];
+  BasicBlock *body_bb = new_block(lo);
+  BasicBlock *end = new_block(lo);
+
+  if (cond) {
+    lower_cond(lo, cond, body_bb, end);
+  } else {
+    jmp(lo, body_bb);
+  }
+  start_block(lo, body_bb);
+  lower_stmt(lo, body, false);
+  if (post) {
+    lower_expr(lo, post);
+  }
+  if (cond) {
+    lower_cond(lo, cond, body_bb, end);
+  } else {
+    jmp(lo, body_bb);
+  }
+  start_block(lo, end);
+}
+
+/*
+ * Lowers the statement. The value of the expression statement in the tail
+ * position, after which the program ends, is returned from the function.
+ */
+static void lower_stmt(Lower *lo, NodeId node, bool tail) {
+  switch (lo->ast->kind[node]) {
+    case ND_IF:
+      lower_if(lo, node, tail);
+      return;
+    case ND_WHILE:
+      lower_while(lo, node);
+      return;
+    case ND_FOR:
+      lower_for(lo, node);
+      return;
+    case ND_BLOCK:
+      for (NodeId cur = lo->ast->lhs[node]; cur; cur = lo->ast->next[cur]) {
+        lower_stmt(lo, cur, tail && !lo->ast->next[cur]);
+      }
+      return;
+    case ND_RETURN:
+      ret(lo, lower_expr(lo, lo->ast->lhs[node]));
+      return;
+  }
+
+  int val = lower_expr(lo, node);
+  if (tail) {
+    ret(lo, val);
+  }
+}
+
+/**
+ * Lowers the AST of the function to the IR.
+ *
+ * The local variables stay in the stack frame and the virtual registers only
+ * hold the temporaries, which never live across the basic blocks. The value
+ * of the expression statement that ends the program is returned from it.
+ *
+ * @param c       the context of the compilation
+ * @param program the function to be lowered
+ * @return the lowered function
+ */
+IrFunc *lower(Context *c, const Function *program) {
+  Lower lowering = {
+    .c = c,
+    .fn = arena_alloc(c, MEM_IR, sizeof(IrFunc)),
+    .ast = program->ast,
+    .vars = program->vars,
+  };
+  Lower *lo = &lowering;
+  lo->fn->stack_size = program->stack_size;
+  start_block(lo, new_block(lo));
+
+  for (NodeId cur = program->node; cur; cur = lo->ast->next[cur]) {
+    lower_stmt(lo, cur, !lo->ast->next[cur]);
+  }
+
+  // Return 0 when the program falls off the end without a value.
+  IrInsn *insn = new_insn(lo, IR_IMM);
+  insn->dst = new_vreg(lo);
+  insn->imm = 0;
+  new_insn(lo, IR_RET)->a = insn->dst;
+
+  return lo->fn;
+}
+
+// The names of the binary operations indexed by IrOp.
+static const char *binary_ops[] = {
+  [IR_ADD] = "+", [IR_SUB] = "-", [IR_MUL] = "*", [IR_DIV] = "/",
+  [IR_EQ] = "==", [IR_NE] = "!=", [IR_LT] = "<", [IR_LE] = "<=",
+};
+
+/**
+ * Prints the IR in the human readable form into the output buffer.
+ *
+ * @param c  the context of the compilation
+ * @param fn the function to be printed
+ */
+void dump_ir(Context *c, const IrFunc *fn) {
+  for (const BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+    emit(c, "bb%d:\n", bb->id);
+    for (const IrInsn *insn = bb->head; insn; insn = insn->next) {
+      switch (insn->op) {
+        case IR_IMM:
+          emit(c, "  v%d = %d\n", insn->dst, insn->imm);
+          break;
+        case IR_LOAD:
+          emit(c, "  v%d = %s\n", insn->dst, insn->lvar->name);
+          break;
+        case IR_STORE:
+          emit(c, "  %s = v%d\n", insn->lvar->name, insn->a);
+          break;
+        case IR_CALL:
+          emit(c, "  v%d = %s(", insn->dst, insn->name);
+          for (int i = 0; i < insn->nargs; i++) {
+            emit(c, i ? ", v%d" : "v%d", insn->args[i]);
+          }
+          emit(c, ")\n");
+          break;
+        case IR_BR:
+          emit(c, "  br v%d, bb%d, bb%d\n", insn->a, insn->then->id,
+               insn->els->id);
+          break;
+        case IR_JMP:
+          emit(c, "  jmp bb%d\n", insn->then->id);
+          break;
+        case IR_RET:
+          emit(c, "  ret v%d\n", insn->a);
+          break;
+        default:
+          if (insn->b) {
+            emit(c, "  v%d = v%d %s v%d\n", insn->dst, insn->a,
+                 binary_ops[insn->op], insn->b);
+          } else {
+            emit(c, "  v%d = v%d %s %d\n", insn->dst, insn->a,
+                 binary_ops[insn->op], insn->imm);
+          }
+          break;
+      }
+    }
+  }
+}
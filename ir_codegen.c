@@ -0,0 +1,502 @@
+#include "pcc.h"
+
+static const Reg arg_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+#define NUM_ARG_REGS ((int)(sizeof(arg_regs) / sizeof(*arg_regs)))
+
+// The registers allocated to the virtual registers. The argument registers are
+// kept out so that the arguments can be moved to them without conflicts, and
+// RAX and RDX are kept out as the scratch registers for idiv and setcc.
+// The caller-saved ones come first and are preferred for the virtual
+// registers which don't live across calls.
+static const Reg alloc_regs[] = {R10, R11, RBX, R12, R13, R14, R15};
+
+#define NUM_ALLOC_REGS ((int)(sizeof(alloc_regs) / sizeof(*alloc_regs)))
+
+// The number of the caller-saved registers at the head of alloc_regs.
+#define NUM_CALLER_SAVED 2
+
+/*
+ * The live interval of a virtual register over the instruction positions.
+ */
+typedef struct {
+  int vreg;          // The virtual register
+  int start;         // The position where the register is defined
+  int end;           // The last position where the register is used
+  bool across_call;  // True if the register is live across a call
+  int hint;          // The operand whose register is preferred or 0
+  int reg;           // The index to alloc_regs or -1 if it's spilled
+} Interval;
+
+/*
+ * The state of the code generation of a function
+ */
+typedef struct {
+  // The context of the compilation.
+  Context *c;
+  // The instructions being generated.
+  InsnList *out;
+  // The locations of the virtual registers, either registers or stack slots.
+  Operand *locs;
+  // The size of the stack frame including the spill slots.
+  int frame_size;
+  // The offsets of the slots which save the callee-saved registers indexed by
+  // alloc_regs, or 0 if the register is not used.
+  int saved_offsets[NUM_ALLOC_REGS];
+} Gen;
+
+/*
+ * Appends the instruction without operands.
+ */
+static void insn0(Gen *g, InsnKind kind) {
+  add_insn(g->c, g->out, kind, (Operand){}, (Operand){});
+}
+
+/*
+ * Appends the instruction with a single operand.
+ */
+static void insn1(Gen *g, InsnKind kind, Operand dst) {
+  add_insn(g->c, g->out, kind, dst, (Operand){});
+}
+
+/*
+ * Appends the instruction with two operands.
+ */
+static void insn2(Gen *g, InsnKind kind, Operand dst, Operand src) {
+  add_insn(g->c, g->out, kind, dst, src);
+}
+
+/*
+ * Returns the label operand of the basic block.
+ */
+static Operand bb_label(const BasicBlock *bb) {
+  return opd_label("bb", bb->id);
+}
+
+/*
+ * Returns the memory operand of the local variable.
+ */
+static Operand lvar_mem(const LVar *lvar) {
+  return opd_mem(RBP, -lvar->offset);
+}
+
+/*
+ * Compares the intervals by their start positions.
+ */
+static int compare_start(const void *a, const void *b) {
+  return ((const Interval *)a)->start - ((const Interval *)b)->start;
+}
+
+/*
+ * Allocates a new stack slot and returns its offset from RBP.
+ */
+static int new_slot(Gen *g) {
+  g->frame_size += 8;
+  return g->frame_size;
+}
+
+/*
+ * Computes the live intervals of the virtual registers. The instructions are
+ * numbered in the layout order of the blocks, which is valid because the
+ * virtual registers never live across the blocks.
+ */
+static Interval *build_intervals(Context *c, const IrFunc *fn) {
+  Interval *intervals =
+      arena_alloc(c, MEM_OTHER, sizeof(Interval) * (fn->num_vregs + 1));
+  for (int v = 0; v <= fn->num_vregs; v++) {
+    intervals[v].vreg = v;
+    intervals[v].start = -1;
+    intervals[v].reg = -1;
+  }
+
+  // calls[pos] is the number of the calls before the position.
+  int num_insns = 0;
+  for (const BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+    for (const IrInsn *insn = bb->head; insn; insn = insn->next) {
+      num_insns++;
+    }
+  }
+  int *calls = arena_alloc(c, MEM_OTHER, sizeof(int) * (num_insns + 1));
+
+  int pos = 0;
+  for (const BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+    for (const IrInsn *insn = bb->head; insn; insn = insn->next) {
+      calls[pos + 1] = calls[pos] + (insn->op == IR_CALL);
+      if (insn->a) {
+        intervals[insn->a].end = pos;
+      }
+      if (insn->b) {
+        intervals[insn->b].end = pos;
+      }
+      for (int i = 0; i < insn->nargs; i++) {
+        intervals[insn->args[i]].end = pos;
+      }
+      if (insn->dst) {
+        intervals[insn->dst].start = pos;
+        intervals[insn->dst].end = pos;
+        // The binary operations compute the result on the register of the
+        // first operand if it dies there.
+        if (IR_ADD <= insn->op && insn->op <= IR_LE &&
+            (insn->op != IR_DIV || !insn->b) && insn->a != insn->b) {
+          intervals[insn->dst].hint = insn->a;
+        }
+      }
+      pos++;
+    }
+  }
+
+  for (int v = 1; v <= fn->num_vregs; v++) {
+    Interval *it = &intervals[v];
+    // The call defining the register doesn't clobber it.
+    it->across_call = calls[it->end] - calls[it->start + 1] > 0;
+  }
+
+  return intervals;
+}
+
+/*
+ * Allocates the registers to the intervals with the linear scan. When the
+ * registers run out, the interval which ends the last is spilled.
+ */
+static void linear_scan(Context *c, Interval *intervals, int num_vregs) {
+  Interval *sorted =
+      arena_alloc(c, MEM_OTHER, sizeof(Interval) * (num_vregs + 1));
+  memcpy(sorted, intervals + 1, sizeof(Interval) * num_vregs);
+  qsort(sorted, num_vregs, sizeof(Interval), compare_start);
+
+  // The active intervals holding the registers indexed by alloc_regs.
+  Interval *active[NUM_ALLOC_REGS] = {};
+
+  for (int i = 0; i < num_vregs; i++) {
+    Interval *cur = &intervals[sorted[i].vreg];
+
+    // Expire the intervals which end before the current one starts. The
+    // intervals ending at the start are kept so that the operands and the
+    // result of an instruction don't share a register except for the hint.
+    for (int r = 0; r < NUM_ALLOC_REGS; r++) {
+      if (active[r] && active[r]->end < cur->start) {
+        active[r] = NULL;
+      }
+    }
+
+    // The callee-saved registers only are allowed across the calls.
+    int first = cur->across_call ? NUM_CALLER_SAVED : 0;
+    int reg = -1;
+    Interval *hint = cur->hint ? &intervals[cur->hint] : NULL;
+    if (hint && hint->reg >= first && hint->end == cur->start) {
+      reg = hint->reg;
+    }
+    for (int r = first; reg < 0 && r < NUM_ALLOC_REGS; r++) {
+      if (!active[r]) {
+        reg = r;
+      }
+    }
+
+    if (reg < 0) {
+      // Spill the interval which ends the last.
+      int victim = first;
+      for (int r = first + 1; r < NUM_ALLOC_REGS; r++) {
+        if (active[r]->end > active[victim]->end) {
+          victim = r;
+        }
+      }
+      if (active[victim]->end > cur->end) {
+        active[victim]->reg = -1;
+        reg = victim;
+      }
+    }
+
+    cur->reg = reg;
+    if (reg >= 0) {
+      active[reg] = cur;
+    }
+  }
+}
+
+/*
+ * Assigns the locations to the virtual registers after the allocation.
+ */
+static void assign_locations(Gen *g, const Interval *intervals,
+                             int num_vregs) {
+  g->locs = arena_alloc(g->c, MEM_OTHER, sizeof(Operand) * (num_vregs + 1));
+  for (int v = 1; v <= num_vregs; v++) {
+    int reg = intervals[v].reg;
+    if (reg < 0) {
+      g->locs[v] = opd_mem(RBP, -new_slot(g));
+      continue;
+    }
+    g->locs[v] = opd_reg(alloc_regs[reg]);
+    if (reg >= NUM_CALLER_SAVED && !g->saved_offsets[reg]) {
+      g->saved_offsets[reg] = new_slot(g);
+    }
+  }
+}
+
+/*
+ * Generates the code restoring the callee-saved registers and tearing down
+ * the stack frame.
+ */
+static void gen_leave(Gen *g) {
+  for (int r = NUM_CALLER_SAVED; r < NUM_ALLOC_REGS; r++) {
+    if (g->saved_offsets[r]) {
+      insn2(g, IN_MOV, opd_reg(alloc_regs[r]),
+            opd_mem(RBP, -g->saved_offsets[r]));
+    }
+  }
+  insn2(g, IN_MOV, opd_reg(RSP), opd_reg(RBP));
+  insn1(g, IN_POP, opd_reg(RBP));
+}
+
+/*
+ * Generates the epilogue of the function.
+ */
+static void gen_epilogue(Gen *g) {
+  gen_leave(g);
+  insn0(g, IN_RET);
+}
+
+/*
+ * Generates the call whose value is returned right away as the tail call,
+ * which tears down the frame and jumps to the callee so that the callee
+ * returns to the caller directly. The argument registers are disjoint from
+ * the allocated ones and survive the teardown.
+ */
+static void gen_tail_call(Gen *g, const IrInsn *call) {
+  for (int i = 0; i < call->nargs; i++) {
+    insn2(g, IN_MOV, opd_reg(arg_regs[i]), g->locs[call->args[i]]);
+  }
+  gen_leave(g);
+  insn1(g, IN_JMP, opd_sym(call->name));
+}
+
+/*
+ * Generates the binary operation. The result is computed on the destination
+ * register or on RAX if the destination is spilled.
+ */
+static void gen_binary(Gen *g, const IrInsn *insn) {
+  Operand dst = g->locs[insn->dst];
+  Operand a = g->locs[insn->a];
+  Operand b = g->locs[insn->b];
+  Operand tmp = dst.kind == OPD_REG ? dst : opd_reg(RAX);
+
+  if (!insn->b) {
+    // The multiplication or the division by the constant, which is reduced on
+    // RCX instead of RAX because the division clobbers RAX and RDX. RCX is
+    // free except while the arguments are passed.
+    if (dst.kind != OPD_REG) {
+      tmp = opd_reg(RCX);
+    }
+    insn2(g, IN_MOV, tmp, a);
+    if (insn->op == IR_MUL) {
+      add_mul_imm(g->c, g->out, tmp.reg, insn->imm);
+    } else {
+      add_div_imm(g->c, g->out, tmp.reg, insn->imm);
+    }
+    insn2(g, IN_MOV, dst, tmp);
+    return;
+  }
+
+  switch (insn->op) {
+    case IR_ADD:
+      insn2(g, IN_MOV, tmp, a);
+      insn2(g, IN_ADD, tmp, b);
+      break;
+    case IR_SUB:
+      insn2(g, IN_MOV, tmp, a);
+      insn2(g, IN_SUB, tmp, b);
+      break;
+    case IR_MUL:
+      insn2(g, IN_MOV, tmp, a);
+      insn2(g, IN_IMUL, tmp, b);
+      break;
+    case IR_DIV:
+      insn2(g, IN_MOV, opd_reg(RAX), a);
+      insn0(g, IN_CQO);
+      insn1(g, IN_IDIV, b);
+      insn2(g, IN_MOV, tmp, opd_reg(RAX));
+      break;
+    default: {
+      InsnKind set = insn->op == IR_EQ ? IN_SETE :
+                     insn->op == IR_NE ? IN_SETNE :
+                     insn->op == IR_LT ? IN_SETL : IN_SETLE;
+      insn2(g, IN_MOV, tmp, a);
+      insn2(g, IN_CMP, tmp, b);
+      insn1(g, set, opd_reg8(RAX));
+      insn2(g, IN_MOVZB, tmp, opd_reg8(RAX));
+      break;
+    }
+  }
+
+  insn2(g, IN_MOV, dst, tmp);
+}
+
+/*
+ * Generates the jumps of the branch after the flags are set. jcc is taken
+ * when the condition is true and jncc otherwise. The jump to the block next
+ * in the layout is left to the fall-through.
+ */
+static void gen_cond_jump(Gen *g, InsnKind jcc, InsnKind jncc,
+                          const IrInsn *br, const BasicBlock *next) {
+  if (br->els == next) {
+    insn1(g, jcc, bb_label(br->then));
+    return;
+  }
+  insn1(g, jncc, bb_label(br->els));
+  if (br->then != next) {
+    insn1(g, IN_JMP, bb_label(br->then));
+  }
+}
+
+/*
+ * Generates the comparison fused with the branch on its result, which is
+ * never materialized.
+ */
+static void gen_cmp_branch(Gen *g, const IrInsn *cmp, const IrInsn *br,
+                           const BasicBlock *next) {
+  Operand a = g->locs[cmp->a];
+  Operand b = g->locs[cmp->b];
+  if (a.kind != OPD_REG && b.kind != OPD_REG) {
+    insn2(g, IN_MOV, opd_reg(RAX), a);
+    a = opd_reg(RAX);
+  }
+  insn2(g, IN_CMP, a, b);
+
+  switch (cmp->op) {
+    case IR_EQ:
+      gen_cond_jump(g, IN_JE, IN_JNE, br, next);
+      return;
+    case IR_NE:
+      gen_cond_jump(g, IN_JNE, IN_JE, br, next);
+      return;
+    case IR_LT:
+      gen_cond_jump(g, IN_JL, IN_JGE, br, next);
+      return;
+    default:
+      gen_cond_jump(g, IN_JLE, IN_JG, br, next);
+      return;
+  }
+}
+
+/*
+ * Generates the instruction. next is the block following the current one in
+ * the layout.
+ */
+static void gen_insn(Gen *g, const IrInsn *insn, const BasicBlock *next) {
+  switch (insn->op) {
+    case IR_IMM:
+      insn2(g, IN_MOV, g->locs[insn->dst], opd_imm(insn->imm));
+      return;
+    case IR_LOAD:
+      if (g->locs[insn->dst].kind == OPD_REG) {
+        insn2(g, IN_MOV, g->locs[insn->dst], lvar_mem(insn->lvar));
+      } else {
+        insn2(g, IN_MOV, opd_reg(RAX), lvar_mem(insn->lvar));
+        insn2(g, IN_MOV, g->locs[insn->dst], opd_reg(RAX));
+      }
+      return;
+    case IR_STORE:
+      if (g->locs[insn->a].kind == OPD_REG) {
+        insn2(g, IN_MOV, lvar_mem(insn->lvar), g->locs[insn->a]);
+      } else {
+        insn2(g, IN_MOV, opd_reg(RAX), g->locs[insn->a]);
+        insn2(g, IN_MOV, lvar_mem(insn->lvar), opd_reg(RAX));
+      }
+      return;
+    case IR_CALL: {
+      // The arguments beyond the sixth are pushed from the last one after the
+      // padding that keeps RSP aligned to 16 bytes at the call.
+      int nstack = insn->nargs - NUM_ARG_REGS;
+      int size = 0;
+      if (nstack > 0) {
+        size = (nstack + nstack % 2) * 8;
+        if (nstack % 2) {
+          insn2(g, IN_SUB, opd_reg(RSP), opd_imm(8));
+        }
+        for (int i = insn->nargs - 1; i >= NUM_ARG_REGS; i--) {
+          insn1(g, IN_PUSH, g->locs[insn->args[i]]);
+        }
+      }
+      for (int i = 0; i < insn->nargs && i < NUM_ARG_REGS; i++) {
+        insn2(g, IN_MOV, opd_reg(arg_regs[i]), g->locs[insn->args[i]]);
+      }
+      insn1(g, IN_CALL, opd_sym(insn->name));
+      if (size) {
+        insn2(g, IN_ADD, opd_reg(RSP), opd_imm(size));
+      }
+      insn2(g, IN_MOV, g->locs[insn->dst], opd_reg(RAX));
+      return;
+    }
+    case IR_BR:
+      insn2(g, IN_CMP, g->locs[insn->a], opd_imm(0));
+      gen_cond_jump(g, IN_JNE, IN_JE, insn, next);
+      return;
+    case IR_JMP:
+      insn1(g, IN_JMP, bb_label(insn->then));
+      return;
+    case IR_RET:
+      insn2(g, IN_MOV, opd_reg(RAX), g->locs[insn->a]);
+      gen_epilogue(g);
+      return;
+    default:
+      gen_binary(g, insn);
+      return;
+  }
+}
+
+/**
+ * Generate the machine instructions from the IR. The virtual registers are
+ * allocated to the physical registers with the linear scan.
+ *
+ * @param c  the context of the compilation
+ * @param fn the function from which the instructions are generated
+ * @return the generated instructions
+ */
+InsnList *ir_codegen(Context *c, const IrFunc *fn) {
+  Gen gen = {
+    .c = c,
+    .out = arena_alloc(c, MEM_INSN, sizeof(InsnList)),
+    .frame_size = fn->stack_size,
+  };
+  Gen *g = &gen;
+
+  Interval *intervals = build_intervals(c, fn);
+  linear_scan(c, intervals, fn->num_vregs);
+  assign_locations(g, intervals, fn->num_vregs);
+
+  // Keep RSP aligned to 16 bytes at the calls.
+  g->frame_size = (g->frame_size + 15) / 16 * 16;
+  insn1(g, IN_PUSH, opd_reg(RBP));
+  insn2(g, IN_MOV, opd_reg(RBP), opd_reg(RSP));
+  insn2(g, IN_SUB, opd_reg(RSP), opd_imm(g->frame_size));
+  for (int r = NUM_CALLER_SAVED; r < NUM_ALLOC_REGS; r++) {
+    if (g->saved_offsets[r]) {
+      insn2(g, IN_MOV, opd_mem(RBP, -g->saved_offsets[r]),
+            opd_reg(alloc_regs[r]));
+    }
+  }
+
+  for (const BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+    insn1(g, IN_LABEL, bb_label(bb));
+    for (const IrInsn *insn = bb->head; insn; insn = insn->next) {
+      // Fuse the comparison into the branch if the branch is the only use of
+      // its result.
+      const IrInsn *next = insn->next;
+      if (IR_EQ <= insn->op && insn->op <= IR_LE && next &&
+          next->op == IR_BR && next->a == insn->dst &&
+          intervals[insn->dst].end == intervals[insn->dst].start + 1) {
+        gen_cmp_branch(g, insn, next, bb->next);
+        insn = next;
+        continue;
+      }
+      if (insn->op == IR_CALL && insn->nargs <= NUM_ARG_REGS && next &&
+          next->op == IR_RET && next->a == insn->dst) {
+        gen_tail_call(g, insn);
+        insn = next;
+        continue;
+      }
+      gen_insn(g, insn, bb->next);
+    }
+  }
+
+  return g->out;
+}
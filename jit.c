@@ -0,0 +1,142 @@
+#define _GNU_SOURCE  // For RTLD_DEFAULT
+
+#include "pcc.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// The size of the stub jumping to an external function. The stub is
+// "jmp [rip+0]" followed by the 64bit address of the function, padded to 16
+// bytes.
+#define STUB_SIZE 16
+
+/**
+ * Loads the shared libraries to look up the external functions in.
+ *
+ * @param c the context of the compilation
+ * @param libs the paths to the shared libraries
+ * @param num_libs the number of the libraries
+ * @return the handles of the loaded libraries
+ */
+void **load_libraries(Context *c, const char **libs, int num_libs) {
+  void **handles = arena_alloc(c, MEM_OTHER, sizeof(void *) * (num_libs + 1));
+  for (int i = 0; i < num_libs; i++) {
+    handles[i] = dlopen(libs[i], RTLD_NOW | RTLD_LOCAL);
+    if (!handles[i]) {
+      fprintf(stderr, "Cannot load %s: %s\n", libs[i], dlerror());
+      exit(1);
+    }
+  }
+
+  return handles;
+}
+
+/**
+ * Unloads the shared libraries loaded by load_libraries().
+ *
+ * @param handles the handles of the loaded libraries
+ * @param num_handles the number of the libraries
+ */
+void unload_libraries(void **handles, int num_handles) {
+  for (int i = 0; i < num_handles; i++) {
+    dlclose(handles[i]);
+  }
+}
+
+/**
+ * Looks up the external function in the libraries first and then in the
+ * symbols already loaded to pcc, such as the C library.
+ *
+ * @param name the name of the function
+ * @param handles the handles of the loaded libraries
+ * @param num_handles the number of the libraries
+ * @return the address of the function
+ */
+void *resolve_symbol(const char *name, void **handles, int num_handles) {
+  for (int i = 0; i < num_handles; i++) {
+    void *addr = dlsym(handles[i], name);
+    if (addr) {
+      return addr;
+    }
+  }
+
+  void *addr = dlsym(RTLD_DEFAULT, name);
+  if (!addr) {
+    fprintf(stderr, "Undefined symbol: %s\n", name);
+    exit(1);
+  }
+
+  return addr;
+}
+
+/**
+ * Loads the machine code to the executable memory and runs it.
+ *
+ * The calls to the external functions go through the stubs placed after the
+ * code, which hold their absolute addresses, so that the functions can be
+ * anywhere in the address space out of the reach of the 32bit displacements.
+ *
+ * @param c the context of the compilation
+ * @param mc the machine code of main
+ * @param libs the paths to the shared libraries the functions are looked up in
+ * @param num_libs the number of the libraries
+ * @return the value returned from the code
+ */
+int jit_run(Context *c, const MachineCode *mc, const char **libs,
+            int num_libs) {
+  phase_begin(c, "link");
+  void **handles = load_libraries(c, libs, num_libs);
+
+  // Assign a stub to each external function in the order of the first call.
+  HashMap stub_map = {};
+  int *stubs = arena_alloc(c, MEM_OTHER, sizeof(int) * (mc->num_relocs + 1));
+  int num_stubs = 0;
+  for (int i = 0; i < mc->num_relocs; i++) {
+    const char *name = mc->relocs[i].name;
+    intptr_t stub = (intptr_t)hashmap_get(&stub_map, name, strlen(name));
+    if (!stub) {
+      stub = ++num_stubs;
+      hashmap_put(c, &stub_map, name, strlen(name), (void *)stub);
+    }
+    stubs[i] = stub - 1;
+  }
+
+  size_t code_size = (mc->len + STUB_SIZE - 1) / STUB_SIZE * STUB_SIZE;
+  size_t size = code_size + STUB_SIZE * num_stubs;
+  unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memcpy(mem, mc->code, mc->len);
+
+  for (int i = 0; i < mc->num_relocs; i++) {
+    const Reloc *reloc = &mc->relocs[i];
+    unsigned char *stub = mem + code_size + STUB_SIZE * stubs[i];
+    if (stub[0] != 0xff) {
+      void *addr = resolve_symbol(reloc->name, handles, num_libs);
+      memcpy(stub, "\xff\x25\0\0\0\0", 6);
+      memcpy(stub + 6, &addr, sizeof(addr));
+    }
+    // The displacement is relative to the end of the 32bit field.
+    int32_t disp = stub - (mem + reloc->offset + 4);
+    memcpy(mem + reloc->offset, &disp, sizeof(disp));
+  }
+
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+    perror("mprotect");
+    exit(1);
+  }
+
+  phase_begin(c, "run");
+  int (*entry)() = (int (*)())mem;
+  int result = entry();
+  phase_end(c);
+
+  munmap(mem, size);
+  unload_libraries(handles, num_libs);
+
+  return result;
+}
@@ -1,26 +1,392 @@
 #include "pcc.h"
 
-// The current token
-Token *token;
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// The whole input
-char *user_input;
+/*
+ * The options given on the command line, which are shared by all
+ * compilations
+ */
+typedef struct {
+  const char *output;  // The output file given with -o or NULL
+  bool use_ir;
+  bool print_ir;
+  bool object;
+  bool time_report;
+  bool mem_report;
+  bool run;
+  bool use_vm;
+  bool print_bc;
+  const char **libs;   // The shared libraries given with --load
+  int num_libs;
+} Options;
 
-int main(int argc,  char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "Invalid number of arguments\n");
-    return 1;
+static Options opts;
+
+// The input files. With more than one of them, the workers take the next one
+// to compile from next_input until they run out.
+static const char **inputs;
+static int num_inputs;
+static atomic_int next_input;
+
+// Serializes the reports of the compilations running concurrently.
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Maps the regular file read-only to the memory.
+ *
+ * The file is mapped right before an anonymous zero-filled page so that the
+ * contents are always null-terminated without copying them, even if the size
+ * of the file is a multiple of the page size. The size of the whole mapping
+ * is stored to mapped.
+ */
+static char *map_file(int fd, size_t size, size_t *mapped) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = (size + page - 1) / page * page;
+
+  // Reserve the whole range including the terminating page first.
+  char *buf = mmap(NULL, len + page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+  if (buf == MAP_FAILED) {
+    return NULL;
+  }
+  if (size && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+      MAP_FAILED) {
+    munmap(buf, len + page);
+    return NULL;
+  }
+  *mapped = len + page;
+
+  return buf;
+}
+
+/*
+ * Reads the whole stream which cannot be mapped, e.g., a pipe, into a
+ * null-terminated buffer.
+ */
+static char *read_stream(int fd) {
+  size_t cap = 4096;
+  size_t len = 0;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    if (len + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    if (!buf) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    ssize_t n = read(fd, buf + len, cap - len - 1);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
+    }
+    len += n;
+  }
+  buf[len] = '\0';
+
+  return buf;
+}
+
+/*
+ * Returns the contents of the file as a null-terminated string. "-" stands
+ * for the standard input. Regular files are mapped to the memory instead of
+ * being copied, and the size of the mapping is stored to mapped, which is 0
+ * for the copied contents.
+ */
+static char *read_file(const char *path, size_t *mapped) {
+  int fd = STDIN_FILENO;
+  if (strcmp(path, "-")) {
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+  }
+
+  struct stat st;
+  char *buf;
+  *mapped = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    buf = map_file(fd, st.st_size, mapped);
+  } else {
+    buf = read_stream(fd);
+  }
+  if (!buf) {
+    fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+
+  return buf;
+}
+
+/*
+ * Releases the contents of the file returned by read_file().
+ */
+static void release_file(char *buf, size_t mapped) {
+  if (mapped) {
+    munmap(buf, mapped);
+  } else {
+    free(buf);
+  }
+}
+
+/*
+ * Print the usage and exit with the failure.
+ */
+static void usage() {
+  fprintf(stderr, "Usage: pcc [-c] [-o <file>] [--ir] [--dump-ir] [--time-report]\n"
+                  "           [--mem-report] [--run | --vm] [--load <lib>]...\n"
+                  "           [--dump-bc] [-j <jobs>] <file>...\n");
+  exit(1);
+}
+
+/*
+ * Prints the requested reports of the compilation. The reports of the
+ * concurrent compilations are printed one by one after the name of the input.
+ */
+static void print_reports(Context *c, long nodes) {
+  if (!opts.time_report && !opts.mem_report) {
+    return;
+  }
+
+  pthread_mutex_lock(&report_lock);
+  if (num_inputs > 1) {
+    fprintf(stderr, "%s:\n", c->input_path);
+  }
+  if (opts.time_report) {
+    print_time_report(c, c->num_tokens, nodes);
   }
+  if (opts.mem_report) {
+    print_mem_report(c);
+  }
+  pthread_mutex_unlock(&report_lock);
+}
+
+/*
+ * Generates the code of the optimized program with the selected backend and
+ * writes it out, or runs it. Returns the value of the program if it's run,
+ * otherwise 0.
+ */
+static int compile_program(Context *c, const Function *prog,
+                           const char *output) {
+  if (opts.use_vm || opts.print_bc) {
+    // Compile the AST to the bytecode and run it or print it.
+    phase_begin(c, "compile");
+    BcFunc *bc = bc_compile(c, prog);
+    if (!opts.print_bc) {
+      return bc_run(c, bc, opts.libs, opts.num_libs);
+    }
+    phase_begin(c, "emit");
+    dump_bc(c, bc);
+    emit_write(c, output);
+    return 0;
+  }
+  InsnList *insns;
+  if (opts.use_ir || opts.print_ir) {
+    // Lower the AST to the IR and generate the instructions from it.
+    phase_begin(c, "lower");
+    IrFunc *fn = lower(c, prog);
+    if (opts.print_ir) {
+      phase_begin(c, "emit");
+      dump_ir(c, fn);
+      emit_write(c, output);
+      return 0;
+    }
+    phase_begin(c, "codegen");
+    insns = ir_codegen(c, fn);
+  } else {
+    // Generate the instructions from the parsed AST.
+    phase_begin(c, "codegen");
+    insns = codegen(c, prog);
+  }
+  // Remove the redundant instructions.
+  phase_begin(c, "peephole");
+  peephole(c, insns);
+  if (opts.run) {
+    // Run the code in place and exit with its value like the program does.
+    phase_begin(c, "encode");
+    return jit_run(c, encode(c, insns), opts.libs, opts.num_libs);
+  }
+  if (opts.object) {
+    // Encode the instructions and write out the object file at once.
+    phase_begin(c, "encode");
+    MachineCode *mc = encode(c, insns);
+    phase_begin(c, "emit");
+    emit_elf(c, mc);
+  } else {
+    // Write out the generated assembly code at once.
+    phase_begin(c, "emit");
+    emit_asm(c, insns);
+  }
+  emit_write(c, output);
+
+  return 0;
+}
 
-  user_input = argv[1];
+/*
+ * Compiles the input file in a new context on the current thread. Returns the
+ * value of the program if it's run, otherwise 0.
+ */
+static int compile_file(const char *input, const char *output) {
+  Context *c = context_new(input, NULL);
+  phase_begin(c, "read");
+  size_t mapped;
+  c->user_input = read_file(input, &mapped);
 
-  // Tokenize the argument.
-  token = tokenize(argv[1]);
+  // Tokenize the input.
+  phase_begin(c, "tokenize");
+  tokenize(c);
+  phase_end(c);
   // Parse the tokenized input.
-  Function *prog = program();
-  LVar *lv = prog->locals;
-  // Generate the assembly code from the parsed AST.
-  codegen(prog);
+  phase_begin(c, "parse");
+  Function *prog = program(c);
+  phase_end(c);
+  long num_nodes = prog->ast->len - 1;
+  // Simplify the parsed AST.
+  phase_begin(c, "optimize");
+  optimize(c, prog);
+  int status = compile_program(c, prog, output);
+
+  // End the last phase so that it doesn't include releasing the arena, and
+  // release all objects allocated during the compilation.
+  phase_end(c);
+  arena_free(c);
+  print_reports(c, num_nodes);
+  release_file(c->user_input, mapped);
+  context_free(c);
+
+  return status;
+}
+
+/*
+ * Returns the path to the output file of the input in the batch compilation,
+ * which is the base name of the input with the suffix replaced by ".s", or
+ * ".o" with -c, in the current directory like cc does.
+ */
+static char *output_path(const char *input) {
+  const char *base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+  const char *dot = strrchr(base, '.');
+  size_t len = dot && dot != base ? (size_t)(dot - base) : strlen(base);
+
+  char *path = malloc(len + 3);
+  if (!path) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memcpy(path, base, len);
+  strcpy(path + len, opts.object ? ".o" : ".s");
+
+  return path;
+}
+
+/*
+ * The worker thread of the batch compilation. It compiles the input files
+ * one by one until all of them are taken.
+ */
+static void *worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    int i = atomic_fetch_add(&next_input, 1);
+    if (i >= num_inputs) {
+      return NULL;
+    }
+    char *output = output_path(inputs[i]);
+    compile_file(inputs[i], output);
+    free(output);
+  }
+}
+
+int main(int argc,  char **argv) {
+  opts.libs = calloc(argc, sizeof(char *));
+  inputs = calloc(argc, sizeof(char *));
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o")) {
+      if (++i == argc) {
+        usage();
+      }
+      opts.output = argv[i];
+    } else if (!strcmp(argv[i], "-c")) {
+      opts.object = true;
+    } else if (!strcmp(argv[i], "-j")) {
+      if (++i == argc || (jobs = atol(argv[i])) < 1) {
+        usage();
+      }
+    } else if (!strcmp(argv[i], "--run")) {
+      opts.run = true;
+    } else if (!strcmp(argv[i], "--vm")) {
+      opts.use_vm = true;
+    } else if (!strcmp(argv[i], "--dump-bc")) {
+      opts.print_bc = true;
+    } else if (!strcmp(argv[i], "--load")) {
+      if (++i == argc) {
+        usage();
+      }
+      opts.libs[opts.num_libs++] = argv[i];
+    } else if (!strcmp(argv[i], "--ir")) {
+      opts.use_ir = true;
+    } else if (!strcmp(argv[i], "--dump-ir")) {
+      opts.print_ir = true;
+    } else if (!strcmp(argv[i], "--time-report")) {
+      opts.time_report = true;
+    } else if (!strcmp(argv[i], "--mem-report")) {
+      opts.mem_report = true;
+    } else {
+      inputs[num_inputs++] = argv[i];
+    }
+  }
+  if (!num_inputs) {
+    usage();
+  }
+  if (num_inputs == 1) {
+    return compile_file(inputs[0], opts.output);
+  }
+
+  // Compile the files concurrently, each into its own output file.
+  if (opts.output || opts.run || opts.use_vm || opts.print_ir ||
+      opts.print_bc) {
+    fprintf(stderr, "-o, --run, --vm, --dump-ir and --dump-bc cannot be used "
+                    "with multiple files\n");
+    usage();
+  }
+  for (int i = 0; i < num_inputs; i++) {
+    if (!strcmp(inputs[i], "-")) {
+      fprintf(stderr, "The standard input cannot be compiled with other files\n");
+      usage();
+    }
+  }
+  int num_threads = jobs < num_inputs ? jobs : num_inputs;
+  pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+  // The main thread works as one of the workers.
+  for (int i = 1; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL)) {
+      fprintf(stderr, "Cannot create a thread\n");
+      exit(1);
+    }
+  }
+  worker(NULL);
+  for (int i = 1; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
 
   return 0;
 }
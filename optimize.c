@@ -0,0 +1,504 @@
+#include "pcc.h"
+
+#include <limits.h>
+
+/*
+ * Examines if the node is a number node with the given value.
+ */
+static inline bool is_num(Ast *ast, NodeId node, int val) {
+  return ast->kind[node] == ND_NUM && ast->val[node] == val;
+}
+
+/*
+ * Stores the children of the node. The new children are passed by value,
+ * since the arrays may be moved by the nodes added while computing them.
+ */
+static inline void set_lhs(Ast *ast, NodeId node, NodeId lhs) {
+  ast->lhs[node] = lhs;
+}
+
+static inline void set_rhs(Ast *ast, NodeId node, NodeId rhs) {
+  ast->rhs[node] = rhs;
+}
+
+static inline void set_val(Ast *ast, NodeId node, NodeId val) {
+  ast->val[node] = val;
+}
+
+/*
+ * Examines if the evaluation of the expression may have side effects, i.e.,
+ * it contains an assignment or a function call.
+ */
+static bool has_side_effects(Ast *ast, NodeId node) {
+  if (!node) {
+    return false;
+  }
+
+  switch (ast->kind[node]) {
+    case ND_ASSIGN:
+    case ND_FUNCALL:
+      return true;
+    case ND_NUM:
+    case ND_LVAR:
+      return false;
+    default:
+      return has_side_effects(ast, ast->lhs[node]) ||
+          has_side_effects(ast, ast->rhs[node]);
+  }
+}
+
+/*
+ * Examines if both expressions always evaluate to the same value without
+ * side effects.
+ */
+static bool same_expr(Ast *ast, NodeId a, NodeId b) {
+  if (ast->kind[a] != ast->kind[b]) {
+    return false;
+  }
+
+  switch (ast->kind[a]) {
+    case ND_NUM:
+    case ND_LVAR:
+      return ast->val[a] == ast->val[b];
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      return same_expr(ast, ast->lhs[a], ast->lhs[b]) &&
+          same_expr(ast, ast->rhs[a], ast->rhs[b]);
+    default:
+      return false;
+  }
+}
+
+/*
+ * Turns the node into a number node with the given value in place.
+ */
+static NodeId to_num(Ast *ast, NodeId node, int val) {
+  ast->kind[node] = ND_NUM;
+  ast->val[node] = val;
+  ast->lhs[node] = 0;
+  ast->rhs[node] = 0;
+
+  return node;
+}
+
+/*
+ * Replaces the node with the other node in place, keeping the link to the
+ * next node so that the chain of the statements or the arguments is kept.
+ */
+static void replace(Ast *ast, NodeId node, NodeId other) {
+  ast->kind[node] = ast->kind[other];
+  ast->lhs[node] = ast->lhs[other];
+  ast->rhs[node] = ast->rhs[other];
+  ast->val[node] = ast->val[other];
+}
+
+/*
+ * Evaluates the binary operation over the constants. Returns false if the
+ * result is not representable or the operation is undefined, e.g., the
+ * division by zero, in which case the operation is left to the runtime.
+ */
+static bool eval(NodeKind kind, long lhs, long rhs, int *val) {
+  long v;
+
+  switch (kind) {
+    case ND_ADD:
+      v = lhs + rhs;
+      break;
+    case ND_SUB:
+      v = lhs - rhs;
+      break;
+    case ND_MUL:
+      v = lhs * rhs;
+      break;
+    case ND_DIV:
+      if (rhs == 0) {
+        return false;
+      }
+      // C99 and idiv both truncate the quotient toward zero.
+      v = lhs / rhs;
+      break;
+    case ND_EQ:
+      v = lhs == rhs;
+      break;
+    case ND_NE:
+      v = lhs != rhs;
+      break;
+    case ND_LT:
+      v = lhs < rhs;
+      break;
+    case ND_LE:
+      v = lhs <= rhs;
+      break;
+    default:
+      return false;
+  }
+
+  if (v < INT_MIN || INT_MAX < v) {
+    return false;
+  }
+  *val = v;
+
+  return true;
+}
+
+/*
+ * Folds the binary operation whose operands are already folded.
+ */
+static NodeId fold_binary(Context *c, Ast *ast, NodeId node) {
+  NodeKind kind = ast->kind[node];
+  NodeId lhs = ast->lhs[node];
+  NodeId rhs = ast->rhs[node];
+  int val;
+
+  if (ast->kind[lhs] == ND_NUM && ast->kind[rhs] == ND_NUM &&
+      eval(kind, ast->val[lhs], ast->val[rhs], &val)) {
+    return to_num(ast, node, val);
+  }
+
+  // Canonicalize the commutative operations to have the constant on the rhs.
+  // Swapping the operands is safe because the constant has no side effects.
+  if (ast->kind[lhs] == ND_NUM && ast->kind[rhs] != ND_NUM &&
+      (kind == ND_ADD || kind == ND_MUL || kind == ND_EQ || kind == ND_NE)) {
+    ast->lhs[node] = rhs;
+    ast->rhs[node] = lhs;
+    lhs = ast->lhs[node];
+    rhs = ast->rhs[node];
+  }
+
+  // Canonicalize the relational comparisons to have the constant on the rhs
+  // too by negating the other one: c < x => !(x <= c), c <= x => !(x < c).
+  // The negation is written as == 0, which the branches are fused with.
+  if (ast->kind[lhs] == ND_NUM && ast->kind[rhs] != ND_NUM &&
+      (kind == ND_LT || kind == ND_LE)) {
+    NodeId cmp = add_node(c, ast, kind == ND_LT ? ND_LE : ND_LT, rhs, lhs);
+    NodeId zero = add_node(c, ast, ND_NUM, 0, 0);
+    ast->val[zero] = 0;
+    // Rewrite the node in place, which may be replaced by its result.
+    ast->kind[node] = ND_EQ;
+    ast->lhs[node] = cmp;
+    ast->rhs[node] = zero;
+    return node;
+  }
+
+  switch (kind) {
+    case ND_ADD:
+      // x + 0 => x
+      if (is_num(ast, rhs, 0)) {
+        return lhs;
+      }
+      // (x + c1) + c2 => x + (c1 + c2)
+      if (ast->kind[rhs] == ND_NUM && ast->kind[lhs] == ND_ADD &&
+          ast->kind[ast->rhs[lhs]] == ND_NUM &&
+          eval(ND_ADD, ast->val[ast->rhs[lhs]], ast->val[rhs], &val)) {
+        ast->val[ast->rhs[lhs]] = val;
+        return fold_binary(c, ast, lhs);
+      }
+      break;
+    case ND_SUB:
+      // x - 0 => x
+      if (is_num(ast, rhs, 0)) {
+        return lhs;
+      }
+      // 0 - (0 - x) => x
+      if (is_num(ast, lhs, 0) && ast->kind[rhs] == ND_SUB &&
+          is_num(ast, ast->lhs[rhs], 0)) {
+        return ast->rhs[rhs];
+      }
+      // x - x => 0
+      if (same_expr(ast, lhs, rhs)) {
+        return to_num(ast, node, 0);
+      }
+      // x - c => x + (-c) so that it can be merged with other constants.
+      if (ast->kind[rhs] == ND_NUM && ast->val[rhs] != INT_MIN) {
+        ast->kind[node] = ND_ADD;
+        ast->val[rhs] = -ast->val[rhs];
+        return fold_binary(c, ast, node);
+      }
+      break;
+    case ND_MUL:
+      // x * 1 => x
+      if (is_num(ast, rhs, 1)) {
+        return lhs;
+      }
+      // x * 0 => 0
+      if (is_num(ast, rhs, 0) && !has_side_effects(ast, lhs)) {
+        return to_num(ast, node, 0);
+      }
+      // (x * c1) * c2 => x * (c1 * c2)
+      if (ast->kind[rhs] == ND_NUM && ast->kind[lhs] == ND_MUL &&
+          ast->kind[ast->rhs[lhs]] == ND_NUM &&
+          eval(ND_MUL, ast->val[ast->rhs[lhs]], ast->val[rhs], &val)) {
+        ast->val[ast->rhs[lhs]] = val;
+        return fold_binary(c, ast, lhs);
+      }
+      break;
+    case ND_DIV:
+      // x / 1 => x
+      if (is_num(ast, rhs, 1)) {
+        return lhs;
+      }
+      break;
+    case ND_EQ:
+    case ND_LE:
+      // x == x => 1, x <= x => 1
+      if (same_expr(ast, lhs, rhs)) {
+        return to_num(ast, node, 1);
+      }
+      break;
+    case ND_NE:
+    case ND_LT:
+      // x != x => 0, x < x => 0
+      if (same_expr(ast, lhs, rhs)) {
+        return to_num(ast, node, 0);
+      }
+      break;
+  }
+
+  return node;
+}
+
+static void fold_in_place(Context *c, Ast *ast, NodeId node);
+
+/*
+ * Folds the expression and returns the simplified node, which may be the
+ * given node, one of its descendants or the given node rewritten in place.
+ */
+static NodeId fold(Context *c, Ast *ast, NodeId node) {
+  switch (ast->kind[node]) {
+    case ND_NUM:
+    case ND_LVAR:
+      return node;
+    case ND_ASSIGN:
+      set_rhs(ast, node, fold(c, ast, ast->rhs[node]));
+      return node;
+    case ND_FUNCALL:
+      for (NodeId arg = ast->lhs[node]; arg; arg = ast->next[arg]) {
+        fold_in_place(c, ast, arg);
+      }
+      return node;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      set_lhs(ast, node, fold(c, ast, ast->lhs[node]));
+      set_rhs(ast, node, fold(c, ast, ast->rhs[node]));
+      return fold_binary(c, ast, node);
+    default:
+      return node;
+  }
+}
+
+/*
+ * Folds the expression chained by next in place, which is an argument or an
+ * expression statement.
+ */
+static void fold_in_place(Context *c, Ast *ast, NodeId node) {
+  NodeId folded = fold(c, ast, node);
+  if (folded != node) {
+    replace(ast, node, folded);
+  }
+}
+
+/*
+ * Folds the expressions in the statement in place.
+ */
+static void fold_stmt(Context *c, Ast *ast, NodeId node) {
+  switch (ast->kind[node]) {
+    case ND_IF:
+      set_lhs(ast, node, fold(c, ast, ast->lhs[node]));
+      fold_stmt(c, ast, ast->rhs[node]);
+      if (ast->val[node]) {
+        fold_stmt(c, ast, ast->val[node]);
+      }
+      return;
+    case ND_WHILE:
+      set_lhs(ast, node, fold(c, ast, ast->lhs[node]));
+      fold_stmt(c, ast, ast->rhs[node]);
+      return;
+    case ND_FOR:
+      if (ast->lhs[node]) {
+        set_lhs(ast, node, fold(c, ast, ast->lhs[node]));
+      }
+      if (ast->val[node]) {
+        set_val(ast, node, fold(c, ast, ast->val[node]));
+      }
+      fold_stmt(c, ast, ast->rhs[node]);
+      return;
+    case ND_BLOCK:
+      for (NodeId cur = ast->lhs[node]; cur; cur = ast->next[cur]) {
+        fold_stmt(c, ast, cur);
+      }
+      return;
+    case ND_RETURN:
+      set_lhs(ast, node, fold(c, ast, ast->lhs[node]));
+      return;
+    default:
+      // The node is an expression statement.
+      fold_in_place(c, ast, node);
+      return;
+  }
+}
+
+/*
+ * Turns the statement into an empty block in place.
+ */
+static NodeId to_empty(Ast *ast, NodeId node) {
+  ast->kind[node] = ND_BLOCK;
+  ast->next[node] = 0;
+  ast->lhs[node] = 0;
+  ast->rhs[node] = 0;
+
+  return node;
+}
+
+static NodeId prune_list(Context *c, Ast *ast, NodeId list);
+
+/*
+ * Removes the dead code under the body of if, while or for, and returns the
+ * new body.
+ */
+static NodeId prune_body(Context *c, Ast *ast, NodeId node) {
+  // The body is pruned as the list of itself, which never becomes empty
+  // since the empty block is left at the end. Several statements are put
+  // into a new block.
+  NodeId list = prune_list(c, ast, node);
+  if (!ast->next[list]) {
+    return list;
+  }
+
+  return add_node(c, ast, ND_BLOCK, list, 0);
+}
+
+/*
+ * Returns the statements that the statement is reduced to by resolving the
+ * branch on the constant condition: the statement itself, the chain of the
+ * other statements or 0 if nothing remains. The nested statements are
+ * pruned only if the statement itself is returned.
+ */
+static NodeId reduce(Context *c, Ast *ast, NodeId node) {
+  NodeId cond = ast->lhs[node];
+
+  switch (ast->kind[node]) {
+    case ND_IF:
+      if (ast->kind[cond] == ND_NUM) {
+        NodeId taken = ast->val[cond] ? ast->rhs[node] : ast->val[node];
+        if (taken && ast->kind[taken] == ND_BLOCK) {
+          return ast->lhs[taken];
+        }
+        return taken;
+      }
+      set_rhs(ast, node, prune_body(c, ast, ast->rhs[node]));
+      if (ast->val[node]) {
+        set_val(ast, node, prune_body(c, ast, ast->val[node]));
+      }
+      return node;
+    case ND_WHILE:
+    case ND_FOR:
+      if (cond && ast->kind[cond] == ND_NUM) {
+        if (!ast->val[cond]) {
+          return 0;
+        }
+        if (ast->kind[node] == ND_FOR) {
+          // for (...; 1; ...) loops forever like for (...; ; ...).
+          ast->lhs[node] = 0;
+        }
+      }
+      set_rhs(ast, node, prune_body(c, ast, ast->rhs[node]));
+      return node;
+    case ND_BLOCK:
+      set_lhs(ast, node, prune_list(c, ast, cond));
+      return node;
+    default:
+      return node;
+  }
+}
+
+/*
+ * Removes the dead code from the list of the statements and returns the
+ * first statement of the new list. The branches on the constant conditions
+ * are replaced by the taken bodies and the statements after return are
+ * dropped.
+ */
+static NodeId prune_list(Context *c, Ast *ast, NodeId list) {
+  NodeId head = 0;
+  NodeId tail = 0;
+
+  while (list) {
+    NodeId cur = list;
+    list = ast->next[cur];
+    NodeId stmts = reduce(c, ast, cur);
+    if (stmts == cur) {
+      if (tail) {
+        ast->next[tail] = cur;
+      } else {
+        head = cur;
+      }
+      tail = cur;
+      if (ast->kind[cur] == ND_RETURN) {
+        // The following statements are unreachable.
+        break;
+      }
+      continue;
+    }
+
+    if (!list && (!stmts || ast->kind[cur] != ND_IF)) {
+      // Leave the empty block at the end in place of the statement, so that
+      // the value of the preceding expression statement isn't returned
+      // instead of falling off the end. The taken body of if stays in the
+      // tail position as it was.
+      NodeId empty = to_empty(ast, cur);
+      if (!stmts) {
+        stmts = empty;
+      } else {
+        list = empty;
+      }
+    }
+    // The replacing statements are pruned in turn followed by the rest.
+    if (stmts) {
+      NodeId last = stmts;
+      while (ast->next[last]) {
+        last = ast->next[last];
+      }
+      ast->next[last] = list;
+      list = stmts;
+    }
+  }
+
+  if (tail) {
+    ast->next[tail] = 0;
+  }
+
+  return head;
+}
+
+/**
+ * Simplifies the AST of the function in place.
+ *
+ * The constant subexpressions are folded, the algebraic identities such as
+ * x + 0, x * 1, x * 0, x - x and the double negation are applied and the
+ * commutative operations and the comparisons are canonicalized to have the
+ * constant on the rhs, where c < x and c <= x are negated into !(x <= c) and
+ * !(x < c) written as == 0. Then the dead code is removed: the if statements
+ * with the constant conditions are replaced by the taken bodies, the loops
+ * that never run and the statements after return are dropped.
+ *
+ * @param c the context of the compilation
+ * @param program the function to be optimized
+ */
+void optimize(Context *c, Function *program) {
+  Ast *ast = program->ast;
+  for (NodeId cur = program->node; cur; cur = ast->next[cur]) {
+    fold_stmt(c, ast, cur);
+  }
+  program->node = prune_list(c, ast, program->node);
+}
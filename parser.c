@@ -1,83 +1,70 @@
 #include "pcc.h"
 
-// The entire parsed code in AST.
-Node *code[100];
-
-// The list of local variables. All local variables created during the parsing
-// are accumulated to this list. Newer variables are prepended to the list and
-// the head of the list is the latest defined vvariable. It is initialized with
-// NULL that represents the end of the list.
-static LVar* locals = NULL;
-
 /*
  * Create a new AST node
  *
+ * @param c    the context of the compilation
  * @param kind the kind of the AST node to create
  * @param lhs  the lhs of the AST node to create
  * @param rhs  the rhs of the AST node to create
- * @return the pointer to the created AST node
+ * @return the index of the created AST node
  */
-static Node *new_node(NodeKind kind, const Node *lhs, const Node *rhs) {
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = kind;
-  node->lhs = lhs;
-  node->rhs = rhs;
-
-  return node;
+static NodeId new_node(Context *c, NodeKind kind, NodeId lhs, NodeId rhs) {
+  return add_node(c, c->ast, kind, lhs, rhs);
 }
 
 /*
  * Create a new AST node for a number
  *
+ * @param c   the context of the compilation
  * @param val the value of the AST number node to create
- * @return the pointer to the created number node
+ * @return the index of the created number node
  */
-static Node *new_node_num(int val) {
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = ND_NUM;
-  node->val = val;
+static NodeId new_node_num(Context *c, int val) {
+  NodeId node = add_node(c, c->ast, ND_NUM, 0, 0);
+  c->ast->val[node] = val;
 
   return node;
 }
 
 /*
- * Finds a local variable by its name.
+ * Finds a local variable by its name with a single probe to the symbol table.
  *
  * @return the found local variable if any, otherwise the null pointer
  */
-static LVar *find_lvar(const Token *tok) {
-  for (LVar *var = locals; var; var = var->next) {
-    if (!strncmp(tok->str, var->name, tok->len)) {
-      return var;
-    }
-  }
-
-  return NULL;
+static LVar *find_lvar(Context *c, const Token *tok) {
+  return hashmap_get(&c->lvar_map, tok->str, tok->len);
 }
 
-
-static LVar *new_lvar(const char *name) {
-  LVar *lvar = calloc(1, sizeof(LVar));
-  lvar->next = locals;
+/*
+ * Creates a new local variable. All local variables created during the parsing
+ * are accumulated to the list in the context. Newer variables are prepended to
+ * the list and the head of the list is the latest defined variable.
+ */
+static LVar *new_lvar(Context *c, const char *name) {
+  LVar *lvar = arena_alloc(c, MEM_LVAR, sizeof(LVar));
+  lvar->next = c->locals;
   lvar->name = name;
-  lvar->offset = (locals ? locals->offset : 0) + 8;
-  locals = lvar;
+  lvar->offset = (c->locals ? c->locals->offset : 0) + 8;
+  c->locals = lvar;
+  hashmap_put(c, &c->lvar_map, name, strlen(name), lvar);
 
   return lvar;
 }
 
-static Node *new_lvar_node(LVar *lvar) {
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = ND_LVAR;
-  node->lvar = lvar;
+static NodeId new_lvar_node(Context *c, const LVar *lvar) {
+  NodeId node = add_node(c, c->ast, ND_LVAR, 0, 0);
+  c->ast->val[node] = lvar->offset / 8 - 1;
 
   return node;
 }
 
-static Node *new_funcall_node(const char *name) {
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = ND_FUNCALL;
-  node->name = name;
+static NodeId new_funcall_node(Context *c, const char *name, NodeId args,
+                               int nargs) {
+  NodeId node = add_node(c, c->ast, ND_FUNCALL, args, nargs);
+  c->ast->val[node] = add_callee(c, c->ast, name);
+
+  return node;
 }
 
 // Production rules:
@@ -98,40 +85,67 @@ static Node *new_funcall_node(const char *name) {
 //   primary    = num
 //              | ident ( "(" expr? ("," expr)* ")" )?
 //              | "(" expr ")"
-static Node *stmt();
-static Node *expr();
-static Node *assign();
-static Node *equality();
-static Node *relational();
-static Node *add();
-static Node *mul();
-static Node *unary();
-static Node *primary();
+static NodeId stmts(Context *c, bool top);
+static NodeId stmt(Context *c);
+static NodeId expr(Context *c);
+static NodeId assign(Context *c);
+static NodeId equality(Context *c);
+static NodeId relational(Context *c);
+static NodeId add(Context *c);
+static NodeId mul(Context *c);
+static NodeId unary(Context *c);
+static NodeId primary(Context *c);
 
 /**
  * Parse tokens with the "program" production rule
  *
  *   stmt       = expr ";"
  *
- * The parsed result is store in the global variable "code".
+ * @return the parsed code as a function
  */
-Function *program() {
-  Node head = {};
-  Node *cur = &head;
-
-  while (!at_eof()) {
-    cur->next = stmt();
-    cur = cur->next;
+Function *program(Context *c) {
+  // Expect a node for each token, which is the common case.
+  c->ast = new_ast(c, c->num_tokens);
+  NodeId node = stmts(c, true);
+
+  Function *program = arena_alloc(c, MEM_OTHER, sizeof(Function));
+  program->ast = c->ast;
+  program->node = node;
+  program->stack_size = c->locals ? c->locals->offset : 0;
+  int num_vars = program->stack_size / 8;
+  program->vars = arena_alloc(c, MEM_OTHER, sizeof(LVar *) * (num_vars + 1));
+  for (LVar *lvar = c->locals; lvar; lvar = lvar->next) {
+    program->vars[lvar->offset / 8 - 1] = lvar;
   }
 
-  Function *program = calloc(1, sizeof(Function));
-  program->node = head.next;
-  program->locals = locals;
-  program->stack_size = locals ? locals->offset : 0;
-
   return program;
 }
 
+/*
+ * Parse the statements until the end of the block or the input, and returns
+ * the first one of the statements chained by next.
+ *
+ * @param c   the context of the compilation
+ * @param top true if the statements are at the top level
+ * @return the first statement
+ */
+static NodeId stmts(Context *c, bool top) {
+  NodeId head = 0;
+  NodeId tail = 0;
+
+  while (top ? !at_eof(c) : !consume(c, TK_RBRACE)) {
+    NodeId node = stmt(c);
+    if (tail) {
+      c->ast->next[tail] = node;
+    } else {
+      head = node;
+    }
+    tail = node;
+  }
+
+  return head;
+}
+
 /*
  * Parse tokens with the "stmt" production rule
  *
@@ -144,59 +158,64 @@ Function *program() {
  *
  * @return the constructed AST node
  */
-static Node *stmt() {
-  Node *node;
-
-  if (consume("{")) {
-    node = new_node(ND_BLOCK, NULL, NULL);
-    Node *head = node;
-    while (!consume("}")) {
-        node->next = stmt();
-        node = node->next;
+static NodeId stmt(Context *c) {
+  NodeId node;
+
+  if (consume(c, TK_LBRACE)) {
+    // The statements in the block are chained from lhs so that next links
+    // the block itself to the following statement.
+    return new_node(c, ND_BLOCK, stmts(c, false), 0);
+  } else if (consume(c, TK_IF)) {
+    expect(c, TK_LPAREN);
+    NodeId cond = expr(c);
+    expect(c, TK_RPAREN);
+    NodeId body = stmt(c);
+    NodeId ebody = 0;
+    if (consume(c, TK_ELSE)) {
+      ebody = stmt(c);
     }
-    return head;
-  } else if (consume("if")) {
-    expect("(");
-    Node *cond = expr();
-    expect(")");
-    Node *body = stmt();
-    Node *ebody = NULL;
-    if (consume("else")) {
-      ebody = stmt();
-    }
-    node = new_node(ND_IF, cond, new_node(ND_IF, body, ebody));
-    return node;
-  } else if (consume("while")) {
-    expect("(");
-    Node *cond = expr();
-    expect(")");
-    node = new_node(ND_WHILE, cond, stmt());
+    node = new_node(c, ND_IF, cond, body);
+    c->ast->val[node] = ebody;
     return node;
-  } else if (consume("for")) {
-    expect("(");
-    Node *decl = NULL;
-    if (!consume(";")) {
-      decl = expr();
-      expect(";");
+  } else if (consume(c, TK_WHILE)) {
+    expect(c, TK_LPAREN);
+    NodeId cond = expr(c);
+    expect(c, TK_RPAREN);
+    NodeId body = stmt(c);
+    return new_node(c, ND_WHILE, cond, body);
+  } else if (consume(c, TK_FOR)) {
+    expect(c, TK_LPAREN);
+    NodeId decl = 0;
+    if (!consume(c, TK_SEMI)) {
+      decl = expr(c);
+      expect(c, TK_SEMI);
     }
-    Node *cond = NULL;
-    if (!consume(";")) {
-      cond = expr();
-      expect(";");
+    NodeId cond = 0;
+    if (!consume(c, TK_SEMI)) {
+      cond = expr(c);
+      expect(c, TK_SEMI);
     }
-    Node *post = NULL;
-    if (!consume(")")) {
-      post = expr();
-      expect(")");
+    NodeId post = 0;
+    if (!consume(c, TK_RPAREN)) {
+      post = expr(c);
+      expect(c, TK_RPAREN);
     }
-    const Node *body = stmt();
-    return new_node(ND_FOR, decl, new_node(ND_FOR, cond, new_node(ND_FOR, post, body)));
-  } else if (consume("return")) {
-    node = new_node(ND_RETURN, expr(), NULL);
+    NodeId body = stmt(c);
+    node = new_node(c, ND_FOR, cond, body);
+    c->ast->val[node] = post;
+    if (!decl) {
+      return node;
+    }
+    // Put the declaration before the loop in a block.
+    c->ast->next[decl] = node;
+    return new_node(c, ND_BLOCK, decl, 0);
+  } else if (consume(c, TK_RETURN)) {
+    node = expr(c);
+    node = new_node(c, ND_RETURN, node, 0);
   } else {
-    node = expr();
+    node = expr(c);
   }
-  expect(";");
+  expect(c, TK_SEMI);
 
   return node;
 }
@@ -208,8 +227,8 @@ static Node *stmt() {
  *
  * @return the constructed AST node
  */
-static Node *expr() {
-  return assign();
+static NodeId expr(Context *c) {
+  return assign(c);
 }
 
 /*
@@ -219,11 +238,11 @@ static Node *expr() {
  *
  * @return the constructed AST node
  */
-static Node *assign() {
-  Node *node = equality();
+static NodeId assign(Context *c) {
+  NodeId node = equality(c);
 
-  if (consume("=")) {
-    node = new_node(ND_ASSIGN, node, assign());
+  if (consume(c, TK_ASSIGN)) {
+    node = new_node(c, ND_ASSIGN, node, assign(c));
   }
 
   return node;
@@ -236,14 +255,14 @@ static Node *assign() {
  *
  *  @return the constructed AST node
  */
-static Node *equality() {
-  Node *node = relational();
+static NodeId equality(Context *c) {
+  NodeId node = relational(c);
 
   for (;;) {
-    if (consume("==")) {
-      node = new_node(ND_EQ, node, relational());
-    } else if (consume("!=")) {
-      node = new_node(ND_NE, node, relational());
+    if (consume(c, TK_EQ)) {
+      node = new_node(c, ND_EQ, node, relational(c));
+    } else if (consume(c, TK_NE)) {
+      node = new_node(c, ND_NE, node, relational(c));
     } else {
       return node;
     }
@@ -257,20 +276,20 @@ static Node *equality() {
  *
  *  @return the constructed AST node
  */
-static Node *relational() {
-  Node *node = add();
+static NodeId relational(Context *c) {
+  NodeId node = add(c);
 
   for (;;) {
     // flip the operator and the operand positions to canonicalize ">" to "<"
     // and ">=" to "<=".
-    if (consume(">")) {
-      node = new_node(ND_LT, add(), node);
-    } else if (consume(">=")) {
-      node = new_node(ND_LE, add(), node);
-    } else if (consume("<")) {
-      node = new_node(ND_LT, node, add());
-    } else if (consume("<=")) {
-      node = new_node(ND_LE, node, add());
+    if (consume(c, TK_GT)) {
+      node = new_node(c, ND_LT, add(c), node);
+    } else if (consume(c, TK_GE)) {
+      node = new_node(c, ND_LE, add(c), node);
+    } else if (consume(c, TK_LT)) {
+      node = new_node(c, ND_LT, node, add(c));
+    } else if (consume(c, TK_LE)) {
+      node = new_node(c, ND_LE, node, add(c));
     } else {
       return node;
     }
@@ -284,14 +303,14 @@ static Node *relational() {
  *
  * @return the constructed AST node
  */
-static Node *add() {
-  Node *node = mul();
+static NodeId add(Context *c) {
+  NodeId node = mul(c);
 
   for (;;) {
-    if (consume("+")) {
-      node = new_node(ND_ADD, node, mul());
-    } else if (consume("-")) {
-      node = new_node(ND_SUB, node, mul());
+    if (consume(c, TK_PLUS)) {
+      node = new_node(c, ND_ADD, node, mul(c));
+    } else if (consume(c, TK_MINUS)) {
+      node = new_node(c, ND_SUB, node, mul(c));
     } else {
       return node;
     }
@@ -305,14 +324,14 @@ static Node *add() {
  *
  * @return the constructed AST node
  */
-static Node *mul() {
-  Node *node = unary();
+static NodeId mul(Context *c) {
+  NodeId node = unary(c);
 
   for (;;) {
-    if (consume("*")) {
-      node = new_node(ND_MUL, node, unary());
-    } else if (consume("/")) {
-      node = new_node(ND_DIV, node, unary());
+    if (consume(c, TK_STAR)) {
+      node = new_node(c, ND_MUL, node, unary(c));
+    } else if (consume(c, TK_SLASH)) {
+      node = new_node(c, ND_DIV, node, unary(c));
     } else {
       return node;
     }
@@ -326,16 +345,16 @@ static Node *mul() {
  *
  * @return the constructed AST node
  */
-static Node *unary() {
-  if (consume("+")) {
-    return primary();
+static NodeId unary(Context *c) {
+  if (consume(c, TK_PLUS)) {
+    return primary(c);
   }
 
-  if (consume("-")) {
-    return new_node(ND_SUB, new_node_num(0), primary());
+  if (consume(c, TK_MINUS)) {
+    return new_node(c, ND_SUB, new_node_num(c, 0), primary(c));
   }
 
-  return primary();
+  return primary(c);
 }
 
 /*
@@ -347,43 +366,42 @@ static Node *unary() {
  *
  * @return the constructed AST node
  */
-static Node *primary() {
-  if (consume("(")) {
-    Node *node = expr();
-    consume(")");
+static NodeId primary(Context *c) {
+  if (consume(c, TK_LPAREN)) {
+    NodeId node = expr(c);
+    consume(c, TK_RPAREN);
     return node;
   }
 
-  Token *tok = consume_ident();
+  Token *tok = consume_ident(c);
   if (tok) {
-    const char *func = strndup(tok->str, tok->len);
-    if (consume("(")) {
-      Node *args = NULL;
-      const Node *head = NULL;
-      int argn = 0;
-      while (!consume(")")) {
-        if (args == NULL) {
-          args = new_node(ND_FUNCALL, expr(), NULL);
-          head = args;
+    if (consume(c, TK_LPAREN)) {
+      // The arguments are chained by next.
+      NodeId head = 0;
+      NodeId tail = 0;
+      int nargs = 0;
+      while (!consume(c, TK_RPAREN)) {
+        if (tail) {
+          expect(c, TK_COMMA);
+        }
+        NodeId arg = expr(c);
+        if (tail) {
+          c->ast->next[tail] = arg;
         } else {
-          expect(",");
-          args->rhs = new_node(ND_FUNCALL, expr(), NULL);
-          args = args->rhs;
+          head = arg;
         }
-        argn++;
+        tail = arg;
+        nargs++;
       }
-      Node *funcall = new_funcall_node(func);
-      funcall->lhs = head;
-      funcall->val = argn;
-      return funcall;
+      return new_funcall_node(c, intern(c, tok->str, tok->len), head, nargs);
     }
-    LVar *lvar = find_lvar(tok);
+    LVar *lvar = find_lvar(c, tok);
     if (!lvar) {
-      lvar = new_lvar(strndup(tok->str, tok->len));
+      lvar = new_lvar(c, intern(c, tok->str, tok->len));
     }
 
-    return new_lvar_node(lvar);
+    return new_lvar_node(c, lvar);
   }
 
-  return new_node_num(expect_number());
+  return new_node_num(c, expect_number(c));
 }
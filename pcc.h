@@ -1,71 +1,243 @@
-#define _POSIX_C_SOURCE 200809L  // For strndup
+#define _POSIX_C_SOURCE 200809L  // For strnlen
+#define _DEFAULT_SOURCE          // For MAP_ANONYMOUS
 #ifndef PCC_H_
 #define PCC_H_
 
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * The state of one compilation, which is defined at the end
+ */
+typedef struct Context Context;
+
+// Memory allocator
+
+/**
+ * The kind of objects allocated in the arena, by which the allocations are
+ * accounted
+ */
+typedef enum {
+  MEM_TOKEN,   // Token
+  MEM_NODE,    // Node
+  MEM_LVAR,    // LVar
+  MEM_STRING,  // Strings such as the interned names
+  MEM_SYMTAB,  // The tables of the hash maps
+  MEM_IR,      // The IR instructions and basic blocks
+  MEM_INSN,    // The machine instructions
+  MEM_OTHER,   // Anything else, e.g. the tables of the passes
+  NUM_MEM_KINDS,
+} MemKind;
+
+/**
+ * The statistics of the allocations in the arena
+ */
+typedef struct {
+  long count[NUM_MEM_KINDS];  // The number of the objects of each kind
+  long bytes[NUM_MEM_KINDS];  // The requested bytes of each kind
+  long reserved;              // The bytes of the chunks currently held
+  long peak_reserved;         // The maximum of reserved so far
+} ArenaStats;
+
+/**
+ * The chunk of the arena, which is opaque outside the allocator
+ */
+typedef struct Chunk Chunk;
+
+/**
+ * Allocates a zero-filled object in the arena.
+ *
+ * All compiler objects for one compilation are allocated in the arena and
+ * valid until arena_free() is called.
+ *
+ * @param c    the context of the compilation
+ * @param kind the kind of the object, which it is accounted as
+ * @param size the size of the object in bytes
+ * @return the pointer to the allocated object
+ */
+void *arena_alloc(Context *c, MemKind kind, size_t size);
+
+/**
+ * Allocates a zero-filled block in the arena which stores the objects counted
+ * one by one with arena_count(), such as a growable array. Only the bytes of
+ * the block are accounted.
+ *
+ * @param c    the context of the compilation
+ * @param kind the kind of the objects stored in the block
+ * @param size the size of the block in bytes
+ * @return the pointer to the allocated block
+ */
+void *arena_alloc_block(Context *c, MemKind kind, size_t size);
+
+/**
+ * Accounts an object of the kind, which is stored in a block allocated by
+ * arena_alloc_block().
+ *
+ * @param c the context of the compilation
+ * @param kind the kind of the object
+ */
+void arena_count(Context *c, MemKind kind);
+
+/**
+ * Duplicates at most n bytes of the string into the arena.
+ *
+ * @param c the context of the compilation
+ * @param s the string to be duplicated
+ * @param n the maximum number of the bytes to be duplicated
+ * @return the null-terminated copy of the string
+ */
+char *arena_strndup(Context *c, const char *s, size_t n);
+
+/**
+ * Releases all objects allocated in the arena of the context at once.
+ *
+ * @param c the context of the compilation
+ */
+void arena_free(Context *c);
+
+/**
+ * Returns the statistics of the allocations of the compilation.
+ *
+ * @param c the context of the compilation
+ * @return the statistics of the arena
+ */
+const ArenaStats *arena_stats(const Context *c);
+
+
+// Hash map
+
+/**
+ * The entry of the hash map. The entry is empty if the key is NULL.
+ */
+typedef struct {
+  const char *key;    // The key, which is not necessarily null-terminated
+  int len;            // The length of the key
+  unsigned int hash;  // The hash value of the key
+  void *val;          // The value associated with the key
+} HashEntry;
+
+/**
+ * The hash map from strings to arbitrary values with open addressing. The
+ * zero-initialized map is an empty map.
+ */
+typedef struct {
+  HashEntry *entries;  // The buckets allocated in the arena
+  int capacity;        // The number of the buckets, which is a power of two
+  int used;            // The number of the non-empty buckets
+} HashMap;
+
+/**
+ * Looks up the value associated with the key.
+ *
+ * @param map the hash map
+ * @param key the pointer to the key, which doesn't need to be null-terminated
+ * @param len the length of the key
+ * @return the value associated with the key if any, otherwise NULL
+ */
+void *hashmap_get(const HashMap *map, const char *key, int len);
+
+/**
+ * Associates the value with the key, replacing the existing value if any.
+ *
+ * The map refers to the key without copying it, so it must outlive the map.
+ *
+ * @param c   the context of the compilation
+ * @param map the hash map
+ * @param key the pointer to the key, which doesn't need to be null-terminated
+ * @param len the length of the key
+ * @param val the value to be associated with the key
+ */
+void hashmap_put(Context *c, HashMap *map, const char *key, int len,
+                 void *val);
+
+/**
+ * Interns the string.
+ *
+ * The same string is always interned to the same pointer in a compilation,
+ * so the interned strings can be compared by their addresses.
+ *
+ * @param c the context of the compilation
+ * @param s the pointer to the string, which doesn't need to be null-terminated
+ * @param len the length of the string
+ * @return the null-terminated interned string
+ */
+const char *intern(Context *c, const char *s, int len);
+
+
 // Tokenizer
 
 /**
- * The kind of tokens
+ * The kind of tokens. Each operator and keyword has its own kind, which is
+ * assigned by the tokenizer, so that the parser matches them by the kind.
  */
 typedef enum {
-  TK_RESERVED,  // Operator token
+  TK_PLUS,      // "+"
+  TK_MINUS,     // "-"
+  TK_STAR,      // "*"
+  TK_SLASH,     // "/"
+  TK_LPAREN,    // "("
+  TK_RPAREN,    // ")"
+  TK_LBRACE,    // "{"
+  TK_RBRACE,    // "}"
+  TK_SEMI,      // ";"
+  TK_COMMA,     // ","
+  TK_ASSIGN,    // "="
+  TK_EQ,        // "=="
+  TK_NOT,       // "!"
+  TK_NE,        // "!="
+  TK_LT,        // "<"
+  TK_LE,        // "<="
+  TK_GT,        // ">"
+  TK_GE,        // ">="
+  TK_IF,        // "if"
+  TK_ELSE,      // "else"
+  TK_WHILE,     // "while"
+  TK_FOR,       // "for"
+  TK_RETURN,    // "return"
   TK_IDENT,     // Identifier
   TK_NUM,       // Number token
-  TK_RETURN,    // "return" token
   TK_EOF,       // End of file, which is the end of the input
 } TokenKind;
 
-typedef struct Token Token;
-
 /**
- * Token type
+ * Token type. The tokens are stored in a contiguous array ending with the
+ * TK_EOF token.
  */
-struct Token {
+typedef struct {
   TokenKind kind;  // The kind of the token
-  Token *next;     // The next input token
   int val;         // The value of the number if the kind of the token is TK_NUM
   char *str;       // The token string
   int len;         // The length of the token
-};
+} Token;
 
 /**
- * The current token
- */
-extern Token *token;
-
-/**
- * The whole input
- */
-extern char *user_input;
-
-/**
- * Report an error.
+ * Report an error with the line of the input where it is found.
  *
  * This function takes the same arguments as printf.
  *
+ * @param c   the context of the compilation
  * @param loc the error location in the input
  * @param fmt the format string
  * @param ... the parameters to be used for the formatting
  */
-void error_at(char *loc, char *fmt, ...);
+void error_at(Context *c, char *loc, char *fmt, ...);
 
 /**
  * Consume a token
  *
- * If the next token is the expected operator, scan a token and return true.
- * Otherwise return false.
+ * If the next token is the expected operator or keyword, scan a token and
+ * return true. Otherwise return false.
  *
- * @param op the pointer to the operator string
+ * @param c    the context of the compilation
+ * @param kind the kind of the expected token
  * @return true if the next token is the expected operator, otherwise false
  */
-bool consume(char *op);
+bool consume(Context *c, TokenKind kind);
 
 /**
  * Consumes an identifier token.
@@ -73,19 +245,21 @@ bool consume(char *op);
  * If the next token is an identifier, scan a token and return the node
  * constructed for the identifier.
  *
+ * @param c the context of the compilation
  * @return the current identifier token
  */
-Token *consume_ident();
+Token *consume_ident(Context *c);
 
 /**
  * Expects a valid token
  *
- * If the next token is the expected operator, scan a token. Otherwise report the
- * error.
+ * If the next token is the expected operator or keyword, scan a token.
+ * Otherwise report the error.
  *
- * @param op the pointer to the operator string
+ * @param c    the context of the compilation
+ * @param kind the kind of the expected token
  */
-void expect(char *op);
+void expect(Context *c, TokenKind kind);
 
 /**
  * Expects a number token
@@ -93,24 +267,26 @@ void expect(char *op);
  * If the token is a number, scan a token and return its value. Otherwise report
  * the error.
  *
+ * @param c the context of the compilation
  * @return the value of the number token if the next token is a number
  */
-int expect_number();
+int expect_number(Context *c);
 
 /**
  * Examine if it is EOF
  *
+ * @param c the context of the compilation
  * @return true if it is EOF, otherwise false
  */
-bool at_eof();
+bool at_eof(Context *c);
 
 /**
- * Tokenize the input string
+ * Tokenize the input of the context into its array of the tokens, and make
+ * the first token current.
  *
- * @param p the pointer to the input string
- * @return the token tokenized from the input string
+ * @param c the context of the compilation
  */
-Token *tokenize(char *p);
+void tokenize(Context *c);
 
 
 // Parser
@@ -145,29 +321,87 @@ typedef struct LVar LVar;
  */
 struct LVar {
   LVar *next;        // The next local variable or NULL.
-  const char *name;  // The name of the local variable.
+  const char *name;  // The interned name of the local variable.
   int offset;        // The offset from the base register, RBP.
 };
 
-typedef struct Node Node;
+/**
+ * The index of the AST node in the Ast. 0 is the null node.
+ */
+typedef int32_t NodeId;
 
 /**
- * The AST node type
+ * The AST nodes stored as the struct of arrays indexed by NodeId, so that a
+ * node takes 17 bytes in the contiguous arrays. The fields are used by the
+ * kinds as follows:
+ *
+ *   kind                 lhs               rhs     val
+ *   ND_NUM                                         the value
+ *   ND_LVAR                                        the index in vars
+ *   binary, ND_ASSIGN    the lhs           the rhs
+ *   ND_FUNCALL           the 1st argument  nargs   the index in callees
+ *   ND_IF                the condition     then    else or 0
+ *   ND_WHILE             the condition     body
+ *   ND_FOR               the condition     body    the post expression or 0
+ *   ND_BLOCK             the 1st statement
+ *   ND_RETURN            the value
+ *
+ * next chains the statements in the block and the arguments of the call. The
+ * declaration of the for statement is put before it in a block.
  */
-struct Node {
-  NodeKind kind;     // The kind of the node
-  Node *next;        // The next AST node that contains another statement
-  const Node *lhs;   // Left hand side
-  const Node *rhs;   // Right hand side
-  int val;           // The value of the integer if the kind is ND_NUM
-  LVar *lvar;        // The local variable only if the kind is ND_LVAR
-  const char *name;  // The name of the funciton only if kind is ND_FUNCALL
-};
+typedef struct {
+  uint8_t *kind;          // The kinds of the nodes, which are NodeKind
+  NodeId *lhs;            // The first operands or children
+  NodeId *rhs;            // The second operands or children
+  NodeId *next;           // The next statements or arguments
+  int32_t *val;           // The payloads specific to the kinds
+  int len;                // The number of the nodes including the null one
+  int cap;                // The capacity of the arrays
+  const char **callees;   // The names of the called functions
+  int num_callees;        // The number of the called functions
+  int cap_callees;        // The capacity of callees
+} Ast;
+
+/**
+ * Creates an empty AST.
+ *
+ * @param c the context of the compilation
+ * @param cap the expected number of the nodes, which are grown beyond
+ * @return the new AST
+ */
+Ast *new_ast(Context *c, int cap);
+
+/**
+ * Appends the node to the AST.
+ *
+ * @param c the context of the compilation
+ * @param ast the AST
+ * @param kind the kind of the node
+ * @param lhs the lhs of the node
+ * @param rhs the rhs of the node
+ * @return the index of the new node
+ */
+NodeId add_node(Context *c, Ast *ast, NodeKind kind, NodeId lhs, NodeId rhs);
+
+/**
+ * Appends the name of the called function to the AST.
+ *
+ * @param c the context of the compilation
+ * @param ast the AST
+ * @param name the interned name of the function
+ * @return the index of the name in callees
+ */
+int add_callee(Context *c, Ast *ast, const char *name);
 
 /**
- * The entire parsed code in AST.
+ * Returns the comparison negated by the node, which the optimizer writes as
+ * the comparison == 0, so that the branches on the node are fused with it.
+ *
+ * @param ast the AST
+ * @param node the node
+ * @return the negated comparison, or 0 if the node is not of the form
  */
-extern Node *code[100];
+NodeId negated_cmp(const Ast *ast, NodeId node);
 
 typedef struct Function Function;
 
@@ -176,8 +410,9 @@ typedef struct Function Function;
  * and required stack size.
  */
 struct Function {
-  Node *node;
-  LVar *locals;
+  Ast *ast;        // The nodes of the function
+  NodeId node;     // The first statement
+  LVar **vars;     // The local variables indexed by their order
   int stack_size;
 };
 
@@ -187,20 +422,639 @@ struct Function {
  *
  *   stmt       = expr ";"
  *
- * The parsed result is store in the global variable "code".
- *
+ * @param c the context of the compilation
  * @return the parsed code as a function
  */
-Function *program();
+Function *program(Context *c);
+
+
+// Optimizer
+
+/**
+ * Simplifies the AST of the function in place.
+ *
+ * The constant subexpressions are folded, the algebraic identities such as
+ * x + 0, x * 1, x * 0, x - x and the double negation are applied and the
+ * commutative operations and the comparisons are canonicalized to have the
+ * constant on the rhs, where c < x and c <= x are negated into !(x <= c) and
+ * !(x < c) written as == 0. Then the dead code is removed: the if statements
+ * with the constant conditions are replaced by the taken bodies, the loops
+ * that never run by their declarations and the statements after return are
+ * dropped.
+ *
+ * @param c       the context of the compilation
+ * @param program the function to be optimized
+ */
+void optimize(Context *c, Function *program);
+
+
+// Intermediate representation
+
+/**
+ * The kind of three-address IR instructions. Virtual registers are numbered
+ * from 1 and each of them is defined exactly once.
+ */
+typedef enum {
+  IR_IMM,    // dst = imm
+  IR_LOAD,   // dst = lvar
+  IR_STORE,  // lvar = a
+  IR_ADD,    // dst = a + b
+  IR_SUB,    // dst = a - b
+  IR_MUL,    // dst = a * b, or a * imm if b is 0
+  IR_DIV,    // dst = a / b, or a / imm if b is 0
+  IR_EQ,     // dst = a == b
+  IR_NE,     // dst = a != b
+  IR_LT,     // dst = a < b
+  IR_LE,     // dst = a <= b
+  IR_CALL,   // dst = name(args...)
+  IR_BR,     // if (a) goto then; else goto els
+  IR_JMP,    // goto then
+  IR_RET,    // return a
+} IrOp;
+
+typedef struct BasicBlock BasicBlock;
+typedef struct IrInsn IrInsn;
+
+/**
+ * The IR instruction
+ */
+struct IrInsn {
+  IrOp op;           // The kind of the instruction
+  IrInsn *next;      // The next instruction in the basic block
+  int dst;           // The defined virtual register or 0
+  int a;             // The first operand virtual register or 0
+  int b;             // The second operand virtual register or 0
+  int imm;           // The immediate value of IR_IMM, IR_MUL or IR_DIV
+  LVar *lvar;        // The local variable only if op is IR_LOAD or IR_STORE
+  const char *name;  // The callee only if op is IR_CALL
+  int *args;         // The argument virtual registers only if op is IR_CALL
+  int nargs;         // The number of the arguments only if op is IR_CALL
+  BasicBlock *then;  // The jump target only if op is IR_BR or IR_JMP
+  BasicBlock *els;   // The jump target on false only if op is IR_BR
+};
+
+/**
+ * The basic block, which ends with IR_BR, IR_JMP or IR_RET.
+ */
+struct BasicBlock {
+  int id;            // The unique id of the block
+  BasicBlock *next;  // The next block in the layout order
+  IrInsn *head;      // The first instruction
+  IrInsn *tail;      // The last instruction
+};
+
+/**
+ * The function in the IR
+ */
+typedef struct {
+  BasicBlock *blocks;  // The blocks in the layout order, the entry first
+  int num_blocks;      // The number of the blocks
+  int num_vregs;       // The number of the virtual registers
+  int stack_size;      // The size of the stack frame for the local variables
+} IrFunc;
+
+/**
+ * Lowers the AST of the function to the IR.
+ *
+ * The local variables stay in the stack frame and the virtual registers only
+ * hold the temporaries, which never live across the basic blocks. The value
+ * of the expression statement that ends the program is returned from it.
+ *
+ * @param c       the context of the compilation
+ * @param program the function to be lowered
+ * @return the lowered function
+ */
+IrFunc *lower(Context *c, const Function *program);
+
+/**
+ * Prints the IR in the human readable form into the output buffer.
+ *
+ * @param c  the context of the compilation
+ * @param fn the function to be printed
+ */
+void dump_ir(Context *c, const IrFunc *fn);
+
+
+// Machine instructions
+
+/**
+ * The x86-64 general purpose registers. The values are the register numbers
+ * used in the instruction encoding.
+ */
+typedef enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+/**
+ * The kind of instruction operands
+ */
+typedef enum {
+  OPD_NONE,   // No operand
+  OPD_REG,    // 64bit register
+  OPD_REG8,   // The lower 8bit of the register
+  OPD_IMM,    // Immediate value
+  OPD_MEM,    // 64bit memory at [reg+index*scale+imm]
+  OPD_LABEL,  // Local label
+  OPD_SYM,    // External symbol
+} OperandKind;
+
+/**
+ * Instruction operand type
+ */
+typedef struct {
+  OperandKind kind;  // The kind of the operand
+  Reg reg;           // The register or the base register of the memory
+  Reg index;         // The index register of the memory if scale is not 0
+  int scale;         // The scale of the index, 1, 2, 4 or 8, or 0 for none
+  long imm;          // The immediate value, the displacement or the label id
+  const char *name;  // The name of the symbol or the label
+} Operand;
+
+/**
+ * The kind of instructions
+ */
+typedef enum {
+  IN_NOP,     // Removed instruction, which is not printed
+  IN_LABEL,   // Label definition
+  IN_MOV,     // mov
+  IN_MOVZB,   // movzb
+  IN_LEA,     // lea
+  IN_PUSH,    // push
+  IN_POP,     // pop
+  IN_ADD,     // add
+  IN_SUB,     // sub
+  IN_IMUL,    // imul
+  IN_IMUL1,   // imul with one operand, RDX:RAX = RAX * dst
+  IN_NEG,     // neg
+  IN_SHL,     // shl
+  IN_SAR,     // sar
+  IN_SHR,     // shr
+  IN_CQO,     // cqo
+  IN_IDIV,    // idiv
+  IN_CMP,     // cmp
+  IN_SETE,    // sete
+  IN_SETNE,   // setne
+  IN_SETL,    // setl
+  IN_SETLE,   // setle
+  IN_JMP,     // jmp
+  IN_JE,      // je
+  IN_JNE,     // jne
+  IN_JL,      // jl
+  IN_JLE,     // jle
+  IN_JG,      // jg
+  IN_JGE,     // jge
+  IN_CALL,    // call
+  IN_RET,     // ret
+} InsnKind;
+
+/**
+ * The machine instruction in the Intel syntax order
+ */
+typedef struct {
+  InsnKind kind;  // The kind of the instruction
+  Operand dst;    // The first operand
+  Operand src;    // The second operand
+} Insn;
+
+/**
+ * The growable array of the instructions of a function
+ */
+typedef struct {
+  Insn *insns;  // The instructions allocated in the arena
+  int len;      // The number of the instructions
+  int cap;      // The capacity of the array
+} InsnList;
+
+/**
+ * Returns the register operand.
+ */
+Operand opd_reg(Reg reg);
+
+/**
+ * Returns the operand for the lower 8bit of the register.
+ */
+Operand opd_reg8(Reg reg);
+
+/**
+ * Returns the immediate operand.
+ */
+Operand opd_imm(long imm);
+
+/**
+ * Returns the memory operand at [base+disp].
+ */
+Operand opd_mem(Reg base, long disp);
+
+/**
+ * Returns the memory operand at [base+index*scale+disp].
+ */
+Operand opd_mem_index(Reg base, Reg index, int scale, long disp);
+
+/**
+ * Returns the local label operand, which is printed as ".L.<name>.<id>".
+ */
+Operand opd_label(const char *name, int id);
+
+/**
+ * Returns the external symbol operand.
+ */
+Operand opd_sym(const char *name);
+
+/**
+ * Appends the instruction to the list.
+ *
+ * @param c    the context of the compilation
+ * @param list the list of the instructions
+ * @param kind the kind of the instruction
+ * @param dst  the first operand or the operand of OPD_NONE
+ * @param src  the second operand or the operand of OPD_NONE
+ */
+void add_insn(Context *c, InsnList *list, InsnKind kind, Operand dst,
+              Operand src);
+
+/**
+ * Appends the instructions multiplying the register by the constant in place.
+ * Shifts and lea are used instead of imul where they do the job.
+ *
+ * @param c the context of the compilation
+ * @param list the list of the instructions
+ * @param reg the register holding the multiplicand and the product
+ * @param imm the multiplier
+ */
+void add_mul_imm(Context *c, InsnList *list, Reg reg, long imm);
+
+/**
+ * Appends the instructions dividing the register by the constant in place
+ * without idiv. The quotient is truncated toward zero like C. RAX and RDX are
+ * clobbered.
+ *
+ * @param c the context of the compilation
+ * @param list the list of the instructions
+ * @param reg the register holding the dividend and the quotient, which must be
+ *            neither RAX nor RDX
+ * @param imm the divisor, which must not be 0
+ */
+void add_div_imm(Context *c, InsnList *list, Reg reg, long imm);
 
 
 // Assembly code generator
 
 /**
- * Generate a series of assembly code that emulates stack machine from the AST
+ * Appends the formatted string to the output buffer.
+ *
+ * Only "%s" for strings, "%d" for ints, "%ld" for longs and "%%" are
+ * supported, which is all the code generator needs. They are expanded without
+ * going through stdio.
+ *
+ * @param c   the context of the compilation
+ * @param fmt the format string
+ * @param ... the parameters to be used for the formatting
+ */
+void emit(Context *c, const char *fmt, ...);
+
+/**
+ * Appends the raw bytes to the output buffer.
+ *
+ * @param c the context of the compilation
+ * @param data the bytes to be appended
+ * @param n the number of the bytes
+ */
+void emit_bytes(Context *c, const void *data, size_t n);
+
+/**
+ * Returns the number of the bytes in the output buffer of the context.
+ *
+ * @param c the context of the compilation
+ * @return the size of the output written so far
+ */
+size_t emit_size(const Context *c);
+
+/**
+ * Writes the whole output buffer of the context to the file at once and
+ * clears the buffer.
+ *
+ * @param c    the context of the compilation
+ * @param path the path to the output file, or NULL or "-" for stdout
+ */
+void emit_write(Context *c, const char *path);
+
+/**
+ * Generate the machine instructions from the AST. The temporary values are
+ * allocated to the registers and spilled to the stack only when they run out.
+ *
+ * @param c       the context of the compilation
+ * @param program the function from which the instructions are generated
+ * @return the generated instructions
+ */
+InsnList *codegen(Context *c, const Function *program);
+
+/**
+ * Generate the machine instructions from the IR. The virtual registers are
+ * allocated to the physical registers with the linear scan.
+ *
+ * @param c  the context of the compilation
+ * @param fn the function from which the instructions are generated
+ * @return the generated instructions
+ */
+InsnList *ir_codegen(Context *c, const IrFunc *fn);
+
+/**
+ * Removes the redundant instruction sequences in place.
+ *
+ * @param c    the context of the compilation
+ * @param list the instructions to be optimized
+ */
+void peephole(Context *c, InsnList *list);
+
+/**
+ * Prints the instructions as the assembly code into the output buffer.
+ *
+ * @param c    the context of the compilation
+ * @param list the instructions to be printed
+ */
+void emit_asm(Context *c, const InsnList *list);
+
+
+// Machine code
+
+/**
+ * The reference to the external symbol in the machine code, which is
+ * relocated as the 32bit PC-relative address of its PLT entry
+ */
+typedef struct {
+  int offset;        // The offset of the 32bit field in the code
+  const char *name;  // The name of the referenced symbol
+} Reloc;
+
+/**
+ * The machine code of a function
+ */
+typedef struct {
+  unsigned char *code;  // The machine code allocated in the arena
+  int len;              // The size of the code in bytes
+  int cap;              // The capacity of the code
+  Reloc *relocs;        // The references to the external symbols
+  int num_relocs;       // The number of the references
+  int cap_relocs;       // The capacity of the references
+} MachineCode;
+
+/**
+ * Encodes the instructions to the x86-64 machine code. The jumps to the
+ * labels are resolved and the calls to the external functions are left as
+ * the relocations.
+ *
+ * @param c    the context of the compilation
+ * @param list the instructions to be encoded
+ * @return the encoded machine code
+ */
+MachineCode *encode(Context *c, const InsnList *list);
+
+/**
+ * Writes the machine code as the ELF64 relocatable object into the output
+ * buffer. The code is placed in .text as the global function "main" and the
+ * external functions are referenced through the undefined symbols.
+ *
+ * @param c  the context of the compilation
+ * @param mc the machine code to be written
+ */
+void emit_elf(Context *c, const MachineCode *mc);
+
+/**
+ * Loads the machine code to the executable memory and runs it.
+ *
+ * The external functions are looked up in the shared libraries and then in
+ * the symbols already loaded to pcc.
+ *
+ * @param c the context of the compilation
+ * @param mc the machine code of main
+ * @param libs the paths to the shared libraries the functions are looked up in
+ * @param num_libs the number of the libraries
+ * @return the value returned from the code
+ */
+int jit_run(Context *c, const MachineCode *mc, const char **libs,
+            int num_libs);
+
+/**
+ * Loads the shared libraries to look up the external functions in.
+ *
+ * @param c the context of the compilation
+ * @param libs the paths to the shared libraries
+ * @param num_libs the number of the libraries
+ * @return the handles of the loaded libraries
+ */
+void **load_libraries(Context *c, const char **libs, int num_libs);
+
+/**
+ * Unloads the shared libraries loaded by load_libraries().
+ *
+ * @param handles the handles of the loaded libraries
+ * @param num_handles the number of the libraries
+ */
+void unload_libraries(void **handles, int num_handles);
+
+/**
+ * Looks up the external function in the libraries first and then in the
+ * symbols already loaded to pcc, such as the C library.
+ *
+ * @param name the name of the function
+ * @param handles the handles of the loaded libraries
+ * @param num_handles the number of the libraries
+ * @return the address of the function
+ */
+void *resolve_symbol(const char *name, void **handles, int num_handles);
+
+
+// Bytecode
+
+/**
+ * The opcodes of the register-based bytecode. a, b and c are the fields of
+ * BcInsn and r[x] is the register x.
+ */
+typedef enum {
+  BC_IMM,   // r[a] = c
+  BC_MOV,   // r[a] = r[b]
+  BC_ADD,   // r[a] = r[b] + r[c]
+  BC_ADDI,  // r[a] = r[b] + c
+  BC_SUB,   // r[a] = r[b] - r[c]
+  BC_MUL,   // r[a] = r[b] * r[c]
+  BC_DIV,   // r[a] = r[b] / r[c]
+  BC_EQ,    // r[a] = r[b] == r[c]
+  BC_NE,    // r[a] = r[b] != r[c]
+  BC_LT,    // r[a] = r[b] < r[c]
+  BC_LE,    // r[a] = r[b] <= r[c]
+  BC_JMP,   // goto c
+  BC_JZ,    // if (!r[a]) goto c
+  BC_CALL,  // r[a] = calls[c](r[b], r[b + 1], ...)
+  BC_RET,   // return r[a]
+} BcOp;
+
+/**
+ * The bytecode instruction
+ */
+typedef struct {
+  uint8_t op;  // The opcode
+  uint16_t a;  // The destination register
+  uint16_t b;  // The first operand register
+  int32_t c;   // The second operand register, the immediate or the target
+} BcInsn;
+
+/**
+ * The call site of an external function
+ */
+typedef struct {
+  const char *name;  // The name of the function
+  int nargs;         // The number of the arguments
+} BcCall;
+
+/**
+ * The function in the bytecode. The local variables live in the registers
+ * from 0 and the temporaries follow them.
+ */
+typedef struct {
+  BcInsn *code;    // The instructions
+  int len;         // The number of the instructions
+  int cap;         // The capacity of the instructions
+  BcCall *calls;   // The call sites indexed by c of BC_CALL
+  int num_calls;   // The number of the call sites
+  int cap_calls;   // The capacity of the call sites
+  int num_regs;    // The number of the registers
+} BcFunc;
+
+/**
+ * Compiles the AST of the function to the bytecode.
+ *
+ * Like the native backends, the value of the expression statement in the
+ * tail position is returned and 0 is returned when the program falls off the
+ * end. Unlike them, the calls take at most 8 arguments and the function has
+ * at most 65536 registers for the local variables and the temporaries.
+ * Otherwise the compilation fails.
+ *
+ * @param c       the context of the compilation
+ * @param program the function to be compiled
+ * @return the compiled function
+ */
+BcFunc *bc_compile(Context *c, const Function *program);
+
+/**
+ * Prints the bytecode in the human readable form into the output buffer.
+ *
+ * @param c  the context of the compilation
+ * @param fn the function to be printed
+ */
+void dump_bc(Context *c, const BcFunc *fn);
+
+/**
+ * Runs the bytecode in the virtual machine.
+ *
+ * @param c the context of the compilation
+ * @param fn the function to be run
+ * @param libs the paths to the shared libraries the functions are looked up in
+ * @param num_libs the number of the libraries
+ * @return the value returned from the function
+ */
+int bc_run(Context *c, const BcFunc *fn, const char **libs, int num_libs);
+
+
+// Compilation report
+
+// The maximum number of the phases of one compilation.
+#define MAX_PHASES 16
+
+/**
+ * The measurement of a phase
+ */
+typedef struct {
+  const char *name;  // The name of the phase
+  double wall;       // The elapsed wall time in seconds
+  double cpu;        // The CPU time of the thread in seconds
+  long allocs;       // The number of the objects allocated in the arena
+  long bytes;        // The bytes allocated in the arena
+  long reserved;     // The bytes of the arena chunks held at the end
+  long peak;         // The peak bytes held by the compilation in the phase
+  long growth;       // The bytes held by the compilation grown in the phase
+} Phase;
+
+/**
+ * Starts measuring the time and the allocations of the phase of the
+ * compilation. The running phase, if any, ends at the same time.
+ *
+ * @param c    the context of the compilation
+ * @param name the name of the phase
+ */
+void phase_begin(Context *c, const char *name);
+
+/**
+ * Ends measuring the running phase.
+ *
+ * @param c the context of the compilation
+ */
+void phase_end(Context *c);
+
+/**
+ * Prints the wall and CPU time of each phase measured so far to stderr.
+ *
+ * @param c      the context of the compilation
+ * @param tokens the number of the tokens of the input
+ * @param nodes  the number of the AST nodes of the input
+ */
+void print_time_report(Context *c, long tokens, long nodes);
+
+/**
+ * Prints the allocations of each kind of the objects and the allocations and
+ * the memory footprint of each phase measured so far to stderr.
+ *
+ * @param c the context of the compilation
+ */
+void print_mem_report(Context *c);
+
+
+
+// Compilation context
+
+/**
+ * The state of one compilation. Every phase and every helper which allocates,
+ * interns, reports or emits takes the context it works on, and the passes keep
+ * their own working state on their stack frames, so that the compilations
+ * share nothing but the immutable tables and each thread can run its own.
+ */
+struct Context {
+  const char *input_path;    // The path to the input file, "-" for stdin
+  char *user_input;          // The whole input
+  Token *tokens;             // The tokens of the input
+  int num_tokens;            // The number of the tokens including TK_EOF
+  int cap_tokens;            // The capacity of tokens
+  Token *token;              // The current token
+  Ast *ast;                  // The AST being parsed
+  LVar *locals;              // The local variables, the latest defined first
+  HashMap lvar_map;          // The local variables keyed by their names
+  HashMap names;             // The interned strings
+  int label_seq;             // The sequence number of the labels of codegen
+  Chunk *chunks;             // The arena chunks, the newest first
+  ArenaStats mem_stats;      // The statistics of the arena
+  char *out_buf;             // The output buffer
+  size_t out_len;            // The number of the bytes in out_buf
+  size_t out_cap;            // The capacity of out_buf
+  Phase phases[MAX_PHASES];  // The phases measured so far
+  int num_phases;            // The number of the phases measured so far
+  Phase *running;            // The phase being measured or NULL
+};
+
+/**
+ * Creates the context of a new compilation.
+ *
+ * @param input_path the path to the input file, "-" for the standard input
+ * @param user_input the whole input, which must outlive the context
+ * @return the created context
+ */
+Context *context_new(const char *input_path, char *user_input);
+
+/**
+ * Releases the context. The objects in its arena must have been released by
+ * arena_free() beforehand.
  *
- * @param program the function from which the assembly code is generated
+ * @param c the context to be released
  */
-void codegen(const Function *program);
+void context_free(Context *c);
 
 #endif  // PCC_H_
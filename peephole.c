@@ -0,0 +1,434 @@
+#include "pcc.h"
+
+// The maximum number of the instructions examined to find if a register is
+// dead, which bounds the time spent on each query.
+#define LIVENESS_BUDGET 64
+
+/*
+ * The labels of the instructions being optimized indexed by label ids
+ */
+typedef struct {
+  int *pos;   // The positions of the labels in the instruction list
+  int *refs;  // The numbers of the jumps to the labels
+} Labels;
+
+// The registers which are used to pass the arguments.
+static const Reg arg_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// The registers which are clobbered by function calls.
+static const Reg caller_saved[] = {
+  RAX, RCX, RDX, RSI, RDI, R8, R9, R10, R11,
+};
+
+/*
+ * Examines if the operand reads the register: the register itself, including
+ * its lower 8bit, or the base or the index register of the memory operand.
+ */
+static bool opd_uses(const Operand *opd, Reg reg) {
+  if (opd->kind == OPD_MEM && opd->scale && opd->index == reg) {
+    return true;
+  }
+  return (opd->kind == OPD_REG || opd->kind == OPD_REG8 ||
+          opd->kind == OPD_MEM) && opd->reg == reg;
+}
+
+/*
+ * Examines if the operand is the 64bit register.
+ */
+static bool is_reg(const Operand *opd, Reg reg) {
+  return opd->kind == OPD_REG && opd->reg == reg;
+}
+
+/*
+ * Examines if both operands are the same.
+ */
+static bool same_opd(const Operand *a, const Operand *b) {
+  return a->kind == b->kind && a->reg == b->reg && a->imm == b->imm &&
+      a->scale == b->scale && (!a->scale || a->index == b->index);
+}
+
+/*
+ * Examines if the register passes an argument.
+ */
+static bool is_arg_reg(Reg reg) {
+  for (int i = 0; i < sizeof(arg_regs) / sizeof(*arg_regs); i++) {
+    if (arg_regs[i] == reg) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Examines if the register must hold the value of the caller on return.
+ */
+static bool is_callee_saved(Reg reg) {
+  return reg == RBX || reg == RBP || reg == RSP || (R12 <= reg && reg <= R15);
+}
+
+/*
+ * Examines if the instruction reads the register.
+ */
+static bool reads(const Insn *insn, Reg reg) {
+  if (reg == RSP &&
+      (insn->kind == IN_PUSH || insn->kind == IN_POP ||
+       insn->kind == IN_CALL || insn->kind == IN_RET)) {
+    return true;
+  }
+
+  switch (insn->kind) {
+    case IN_MOV:
+    case IN_MOVZB:
+    case IN_LEA:
+    case IN_POP:
+      // The destination register is only written.
+      return opd_uses(&insn->src, reg) ||
+          (insn->dst.kind == OPD_MEM && insn->dst.reg == reg);
+    case IN_CQO:
+      return reg == RAX;
+    case IN_IMUL1:
+      return reg == RAX || opd_uses(&insn->dst, reg);
+    case IN_IDIV:
+      return reg == RAX || reg == RDX || opd_uses(&insn->dst, reg);
+    case IN_SETE:
+    case IN_SETNE:
+    case IN_SETL:
+    case IN_SETLE:
+      // setcc preserves the upper bits of the register.
+      return opd_uses(&insn->dst, reg);
+    case IN_CALL:
+      return is_arg_reg(reg);
+    case IN_RET:
+      // The callee-saved registers must hold the values of the caller.
+      return reg == RAX || is_callee_saved(reg);
+    case IN_JMP:
+      // The tail call passes the arguments and returns to the caller.
+      return insn->dst.kind == OPD_SYM &&
+          (is_arg_reg(reg) || is_callee_saved(reg));
+    default:
+      return opd_uses(&insn->dst, reg) || opd_uses(&insn->src, reg);
+  }
+}
+
+/*
+ * Examines if the instruction overwrites the register.
+ */
+static bool writes(const Insn *insn, Reg reg) {
+  switch (insn->kind) {
+    case IN_MOV:
+    case IN_MOVZB:
+    case IN_LEA:
+    case IN_POP:
+    case IN_ADD:
+    case IN_SUB:
+    case IN_IMUL:
+    case IN_NEG:
+    case IN_SHL:
+    case IN_SAR:
+    case IN_SHR:
+    case IN_SETE:
+    case IN_SETNE:
+    case IN_SETL:
+    case IN_SETLE:
+      return opd_uses(&insn->dst, reg) && insn->dst.kind != OPD_MEM;
+    case IN_CQO:
+      return reg == RDX;
+    case IN_IMUL1:
+    case IN_IDIV:
+      return reg == RAX || reg == RDX;
+    case IN_CALL:
+    case IN_RET:
+      // The caller-saved registers are clobbered by the callee or no longer
+      // used by the caller.
+      for (int i = 0; i < sizeof(caller_saved) / sizeof(*caller_saved); i++) {
+        if (caller_saved[i] == reg) {
+          return true;
+        }
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+/*
+ * Examines if the value of the register is never read on any path starting
+ * from the j-th instruction. The paths are followed through the jumps until
+ * the budget of the instructions to be examined runs out, in which case the
+ * register is conservatively regarded as live.
+ */
+static bool dead_from(Labels *labels, const InsnList *list, int j, Reg reg,
+                      int *budget) {
+  for (; j < list->len; j++) {
+    if (--*budget < 0) {
+      return false;
+    }
+
+    const Insn *insn = &list->insns[j];
+    switch (insn->kind) {
+      case IN_NOP:
+      case IN_LABEL:
+        continue;
+      case IN_JMP:
+        if (insn->dst.kind == OPD_SYM) {
+          return !reads(insn, reg);
+        }
+        j = labels->pos[insn->dst.imm];
+        continue;
+      case IN_JE:
+      case IN_JNE:
+      case IN_JL:
+      case IN_JLE:
+      case IN_JG:
+      case IN_JGE:
+        if (!dead_from(labels, list, labels->pos[insn->dst.imm], reg, budget)) {
+          return false;
+        }
+        continue;
+    }
+    if (reads(insn, reg)) {
+      return false;
+    }
+    if (writes(insn, reg)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Examines if the value of the register is never read after the i-th
+ * instruction.
+ */
+static bool dead_after(Labels *labels, const InsnList *list, int i, Reg reg) {
+  if (reg == RSP || reg == RBP) {
+    return false;
+  }
+
+  int budget = LIVENESS_BUDGET;
+
+  return dead_from(labels, list, i + 1, reg, &budget);
+}
+
+/*
+ * Examines if the instruction is a jump to a label.
+ */
+static bool is_jump(const Insn *insn) {
+  if (insn->dst.kind != OPD_LABEL) {
+    return false;
+  }
+
+  switch (insn->kind) {
+    case IN_JMP:
+    case IN_JE:
+    case IN_JNE:
+    case IN_JL:
+    case IN_JLE:
+    case IN_JG:
+    case IN_JGE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*
+ * Removes the instruction, dropping the reference to the label if it jumps.
+ */
+static void remove_insn(Labels *labels, Insn *insn) {
+  if (is_jump(insn)) {
+    labels->refs[insn->dst.imm]--;
+  }
+  insn->kind = IN_NOP;
+}
+
+/*
+ * Returns the index of the next instruction which is not removed.
+ */
+static int next_insn(const InsnList *list, int i) {
+  for (i++; i < list->len && list->insns[i].kind == IN_NOP; i++) {
+  }
+
+  return i;
+}
+
+/*
+ * Examines if the operand can replace the register operand in the i-th
+ * position of the instruction, which is 0 for the destination and 1 for the
+ * source.
+ */
+static bool can_substitute(const Insn *insn, int pos, const Operand *opd) {
+  const Operand *other = pos ? &insn->dst : &insn->src;
+  if (opd->kind == OPD_MEM && other->kind == OPD_MEM) {
+    // x86 has no memory-to-memory operations.
+    return false;
+  }
+
+  switch (insn->kind) {
+    case IN_MOV:
+    case IN_ADD:
+    case IN_SUB:
+    case IN_IMUL:
+      // The destination is written, only the source can be substituted.
+      // imul doesn't take a memory destination either.
+      return pos == 1 && !(insn->kind == IN_IMUL && opd->kind == OPD_MEM &&
+                           other->kind != OPD_REG);
+    case IN_CMP:
+      // cmp doesn't take an immediate as its first operand.
+      return pos == 1 || opd->kind != OPD_IMM;
+    case IN_PUSH:
+      return true;
+    case IN_IDIV:
+      return opd->kind != OPD_IMM;
+    default:
+      return false;
+  }
+}
+
+/*
+ * Applies the patterns to the i-th instruction. Returns true if the list is
+ * changed.
+ */
+static bool apply(Labels *labels, InsnList *list, int i) {
+  Insn *insn = &list->insns[i];
+  int j = next_insn(list, i);
+  Insn *next = j < list->len ? &list->insns[j] : NULL;
+
+  switch (insn->kind) {
+    case IN_MOV:
+      // mov x, x => (removed)
+      if (same_opd(&insn->dst, &insn->src)) {
+        insn->kind = IN_NOP;
+        return true;
+      }
+      if (insn->dst.kind != OPD_REG) {
+        return false;
+      }
+      // mov r, x where r is never read => (removed)
+      if (dead_after(labels, list, i, insn->dst.reg)) {
+        insn->kind = IN_NOP;
+        return true;
+      }
+      // mov r, x; op y, r => op y, x if r is dead afterwards
+      if (next && !opd_uses(&insn->src, insn->dst.reg)) {
+        Reg r = insn->dst.reg;
+        int pos = -1;
+        if (is_reg(&next->src, r) && !opd_uses(&next->dst, r)) {
+          pos = 1;
+        } else if (is_reg(&next->dst, r) && !opd_uses(&next->src, r) &&
+                   next->src.kind != OPD_NONE) {
+          pos = 0;
+        } else if (is_reg(&next->dst, r) && next->src.kind == OPD_NONE) {
+          pos = 0;
+        }
+        if (pos >= 0 && can_substitute(next, pos, &insn->src) &&
+            dead_after(labels, list, j, r)) {
+          *(pos ? &next->src : &next->dst) = insn->src;
+          insn->kind = IN_NOP;
+          return true;
+        }
+      }
+      return false;
+    case IN_PUSH:
+      // push x; pop r => mov r, x
+      if (next && next->kind == IN_POP && next->dst.kind == OPD_REG) {
+        next->kind = IN_MOV;
+        next->src = insn->dst;
+        insn->kind = IN_NOP;
+        return true;
+      }
+      return false;
+    case IN_JMP:
+      // jmp L; L: => L:
+      for (int k = j; k < list->len; k = next_insn(list, k)) {
+        Insn *label = &list->insns[k];
+        if (label->kind != IN_LABEL) {
+          break;
+        }
+        if (same_opd(&label->dst, &insn->dst)) {
+          remove_insn(labels, insn);
+          return true;
+        }
+      }
+      // Fall through to remove the unreachable code.
+    case IN_RET:
+      // The instructions after the unconditional jump are unreachable until
+      // the next label.
+      if (!next || next->kind == IN_LABEL) {
+        return false;
+      }
+      for (; j < list->len && list->insns[j].kind != IN_LABEL; j++) {
+        remove_insn(labels, &list->insns[j]);
+      }
+      return true;
+    case IN_LABEL:
+      // L: => (removed) if nothing jumps to L
+      if (!labels->refs[insn->dst.imm]) {
+        insn->kind = IN_NOP;
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Removes the redundant instruction sequences in place.
+ *
+ * The patterns are applied repeatedly until the instructions don't change:
+ *
+ *   push x; pop r         => mov r, x
+ *   mov x, x              => (removed)
+ *   mov r, x              => (removed) if r is never read
+ *   mov r, x; op y, r     => op y, x if r is dead afterwards
+ *   jmp L; L:             => L:
+ *   jmp L or ret; insn    => jmp L or ret if insn is unreachable
+ *   L:                    => (removed) if nothing jumps to L
+ *
+ * Removing the labels lets the unreachable code after them be removed too.
+ *
+ * @param c the context of the compilation
+ * @param list the instructions to be optimized
+ */
+void peephole(Context *c, InsnList *list) {
+  int num_labels = 0;
+  for (int i = 0; i < list->len; i++) {
+    if (list->insns[i].kind == IN_LABEL &&
+        list->insns[i].dst.imm >= num_labels) {
+      num_labels = list->insns[i].dst.imm + 1;
+    }
+  }
+  Labels labels_of_list = {
+    .pos = arena_alloc(c, MEM_OTHER, sizeof(int) * (num_labels + 1)),
+    .refs = arena_alloc(c, MEM_OTHER, sizeof(int) * (num_labels + 1)),
+  };
+  Labels *labels = &labels_of_list;
+  for (int i = 0; i < list->len; i++) {
+    if (list->insns[i].kind == IN_LABEL) {
+      labels->pos[list->insns[i].dst.imm] = i;
+    } else if (is_jump(&list->insns[i])) {
+      labels->refs[list->insns[i].dst.imm]++;
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < list->len; i++) {
+      if (list->insns[i].kind != IN_NOP && apply(labels, list, i)) {
+        changed = true;
+      }
+    }
+  }
+
+  // Compact the list by dropping the removed instructions.
+  int len = 0;
+  for (int i = 0; i < list->len; i++) {
+    if (list->insns[i].kind != IN_NOP) {
+      list->insns[len++] = list->insns[i];
+    }
+  }
+  list->len = len;
+}
@@ -0,0 +1,144 @@
+#include "pcc.h"
+
+#include <time.h>
+
+// The names of the kinds of the objects indexed by MemKind.
+static const char *mem_kind_names[] = {
+  [MEM_TOKEN] = "Token", [MEM_NODE] = "Node", [MEM_LVAR] = "LVar",
+  [MEM_STRING] = "string", [MEM_SYMTAB] = "symtab", [MEM_IR] = "IR",
+  [MEM_INSN] = "Insn", [MEM_OTHER] = "other",
+};
+
+/*
+ * Returns the time of the clock in seconds.
+ */
+static double clock_time(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sums up the allocation counts and the bytes of all kinds.
+ */
+static void total_allocs(const Context *c, long *allocs, long *bytes) {
+  const ArenaStats *stats = arena_stats(c);
+  *allocs = 0;
+  *bytes = 0;
+  for (int i = 0; i < NUM_MEM_KINDS; i++) {
+    *allocs += stats->count[i];
+    *bytes += stats->bytes[i];
+  }
+}
+
+/*
+ * Returns the bytes held by the compilation, which are the arena chunks and
+ * the output buffer. Neither shrinks until the compilation ends after its last
+ * phase, so the value at the end of a phase is its peak in the phase. Unlike
+ * the resident set size of the process, it doesn't include the other
+ * compilations.
+ */
+static long footprint(const Context *c) {
+  return arena_stats(c)->reserved + c->out_cap;
+}
+
+/**
+ * Starts measuring the time and the allocations of the phase of the
+ * compilation. The running phase, if any, ends at the same time.
+ *
+ * @param c    the context of the compilation
+ * @param name the name of the phase
+ */
+void phase_begin(Context *c, const char *name) {
+  phase_end(c);
+  if (c->num_phases == MAX_PHASES) {
+    return;
+  }
+
+  Phase *running = c->running = &c->phases[c->num_phases++];
+  running->name = name;
+  // Hold the start values until the phase ends.
+  total_allocs(c, &running->allocs, &running->bytes);
+  running->growth = footprint(c);
+  running->wall = clock_time(CLOCK_MONOTONIC);
+  running->cpu = clock_time(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/**
+ * Ends measuring the running phase.
+ *
+ * @param c the context of the compilation
+ */
+void phase_end(Context *c) {
+  Phase *running = c->running;
+  if (!running) {
+    return;
+  }
+
+  running->wall = clock_time(CLOCK_MONOTONIC) - running->wall;
+  running->cpu = clock_time(CLOCK_THREAD_CPUTIME_ID) - running->cpu;
+  long allocs, bytes;
+  total_allocs(c, &allocs, &bytes);
+  running->allocs = allocs - running->allocs;
+  running->bytes = bytes - running->bytes;
+  running->reserved = arena_stats(c)->reserved;
+  running->peak = footprint(c);
+  running->growth = running->peak - running->growth;
+  c->running = NULL;
+}
+
+/**
+ * Prints the wall and CPU time of each phase measured so far to stderr.
+ *
+ * @param c      the context of the compilation
+ * @param tokens the number of the tokens of the input
+ * @param nodes  the number of the AST nodes of the input
+ */
+void print_time_report(Context *c, long tokens, long nodes) {
+  double wall = 0;
+  double cpu = 0;
+
+  phase_end(c);
+  const Phase *phases = c->phases;
+  fprintf(stderr, "%-12s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+  for (int i = 0; i < c->num_phases; i++) {
+    fprintf(stderr, "%-12s %12.3f %12.3f\n", phases[i].name,
+            phases[i].wall * 1e3, phases[i].cpu * 1e3);
+    wall += phases[i].wall;
+    cpu += phases[i].cpu;
+  }
+  fprintf(stderr, "%-12s %12.3f %12.3f\n", "total", wall * 1e3, cpu * 1e3);
+  fprintf(stderr, "tokens: %ld, nodes: %ld\n", tokens, nodes);
+}
+
+/**
+ * Prints the allocations of each kind of the objects and the allocations and
+ * the memory footprint of each phase measured so far to stderr.
+ *
+ * @param c the context of the compilation
+ */
+void print_mem_report(Context *c) {
+  const ArenaStats *stats = arena_stats(c);
+  long allocs = 0;
+  long bytes = 0;
+
+  phase_end(c);
+  fprintf(stderr, "%-12s %12s %12s\n", "kind", "count", "bytes");
+  for (int i = 0; i < NUM_MEM_KINDS; i++) {
+    fprintf(stderr, "%-12s %12ld %12ld\n", mem_kind_names[i], stats->count[i],
+            stats->bytes[i]);
+    allocs += stats->count[i];
+    bytes += stats->bytes[i];
+  }
+  fprintf(stderr, "%-12s %12ld %12ld\n", "total", allocs, bytes);
+  fprintf(stderr, "peak arena: %ld bytes\n\n", stats->peak_reserved);
+
+  const Phase *phases = c->phases;
+  fprintf(stderr, "%-12s %12s %12s %12s %12s %12s\n", "phase", "allocs",
+          "bytes", "arena", "peak (KiB)", "growth (KiB)");
+  for (int i = 0; i < c->num_phases; i++) {
+    fprintf(stderr, "%-12s %12ld %12ld %12ld %12ld %12ld\n", phases[i].name,
+            phases[i].allocs, phases[i].bytes, phases[i].reserved,
+            phases[i].peak / 1024, phases[i].growth / 1024);
+  }
+}
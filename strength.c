@@ -0,0 +1,135 @@
+#include "pcc.h"
+
+/*
+ * Computes the magic number m and the shift s for the signed division by the
+ * constant d, which is at least 3 and not a power of two, so that n / d is
+ * (n * m >> 64 >> s) plus 1 if it's negative, with n * m added back if m
+ * overflows to a negative value. See Hacker's Delight, chapter 10.
+ */
+static void div_magic(unsigned long d, long *m, int *s) {
+  const unsigned long two63 = 1UL << 63;
+  unsigned long anc = two63 - 1 - two63 % d;  // The absolute value of nc
+  unsigned long q1 = two63 / anc;
+  unsigned long r1 = two63 - q1 * anc;
+  unsigned long q2 = two63 / d;
+  unsigned long r2 = two63 - q2 * d;
+  unsigned long delta;
+  int p = 63;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= d) {
+      q2++;
+      r2 -= d;
+    }
+    delta = d - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *m = q2 + 1;
+  *s = p - 64;
+}
+
+/**
+ * Appends the instructions multiplying the register by the constant in place.
+ *
+ * The multipliers of 2^k, 3 * 2^k, 5 * 2^k and 9 * 2^k become lea and shl,
+ * and the negative powers of two shl and neg, which are faster than imul.
+ * The others are left to imul with the immediate.
+ *
+ * @param c the context of the compilation
+ * @param list the list of the instructions
+ * @param reg the register holding the multiplicand and the product
+ * @param imm the multiplier
+ */
+void add_mul_imm(Context *c, InsnList *list, Reg reg, long imm) {
+  Operand r = opd_reg(reg);
+  if (imm == 0) {
+    add_insn(c, list, IN_MOV, r, opd_imm(0));
+    return;
+  }
+
+  unsigned long abs = imm < 0 ? -(unsigned long)imm : imm;
+  int shift = __builtin_ctzl(abs);
+  unsigned long odd = abs >> shift;
+  if ((imm > 0 && (odd == 3 || odd == 5 || odd == 9)) || odd == 1) {
+    if (odd > 1) {
+      add_insn(c, list, IN_LEA, r, opd_mem_index(reg, reg, odd - 1, 0));
+    }
+    if (shift) {
+      add_insn(c, list, IN_SHL, r, opd_imm(shift));
+    }
+    if (imm < 0) {
+      add_insn(c, list, IN_NEG, r, (Operand){});
+    }
+    return;
+  }
+
+  add_insn(c, list, IN_IMUL, r, opd_imm(imm));
+}
+
+/**
+ * Appends the instructions dividing the register by the constant in place
+ * without idiv. The quotient is truncated toward zero like C. RAX and RDX are
+ * clobbered.
+ *
+ * The division by 2^k is the arithmetic shift of the dividend biased by
+ * 2^k - 1 if it's negative, and the others are the multiplications by the
+ * magic numbers. The negative divisors negate the quotient of their absolute
+ * values.
+ *
+ * @param c the context of the compilation
+ * @param list the list of the instructions
+ * @param reg the register holding the dividend and the quotient, which must be
+ *            neither RAX nor RDX
+ * @param imm the divisor, which must not be 0
+ */
+void add_div_imm(Context *c, InsnList *list, Reg reg, long imm) {
+  Operand r = opd_reg(reg);
+  Operand rax = opd_reg(RAX);
+  Operand rdx = opd_reg(RDX);
+  unsigned long abs = imm < 0 ? -(unsigned long)imm : imm;
+
+  if ((abs & (abs - 1)) == 0) {
+    int shift = __builtin_ctzl(abs);
+    if (shift) {
+      // RDX = the dividend < 0 ? 2^shift - 1 : 0
+      add_insn(c, list, IN_MOV, rdx, r);
+      if (shift > 1) {
+        add_insn(c, list, IN_SAR, rdx, opd_imm(63));
+      }
+      add_insn(c, list, IN_SHR, rdx, opd_imm(64 - shift));
+      add_insn(c, list, IN_ADD, r, rdx);
+      add_insn(c, list, IN_SAR, r, opd_imm(shift));
+    }
+  } else {
+    long m;
+    int s;
+    div_magic(abs, &m, &s);
+    // RDX = the upper 64bit of the dividend * m
+    add_insn(c, list, IN_MOV, rax, opd_imm(m));
+    add_insn(c, list, IN_IMUL1, r, (Operand){});
+    if (m < 0) {
+      add_insn(c, list, IN_ADD, rdx, r);
+    }
+    if (s) {
+      add_insn(c, list, IN_SAR, rdx, opd_imm(s));
+    }
+    // Round the negative quotient toward zero.
+    add_insn(c, list, IN_MOV, rax, rdx);
+    add_insn(c, list, IN_SHR, rax, opd_imm(63));
+    add_insn(c, list, IN_ADD, rdx, rax);
+    add_insn(c, list, IN_MOV, r, rdx);
+  }
+
+  if (imm < 0) {
+    add_insn(c, list, IN_NEG, r, (Operand){});
+  }
+}
@@ -9,3 +9,17 @@ int foo() {
 int bar(int a, int b) {
   return a + b;
 }
+
+int sum8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+}
+
+int nine(int a, int b, int c, int d, int e, int f, int g, int h, int i) {
+  return a + b + c + d + e + f + g + h + i;
+}
+
+// Returns 1 if RSP is aligned to 16 bytes at the call as the ABI requires,
+// where the frame pointer is 16 bytes below it.
+int aligned() {
+  return (long)__builtin_frame_address(0) % 16 == 0;
+}
@@ -1,13 +1,30 @@
 #!/bin/bash
 
+# The extra options passed to pcc, which select the backend.
+PCCFLAGS=
+
+# The output of pcc, the assembly code or the object file with -c.
+PCCOUT=tmp.s
+
+# The option running the programs in pcc, --run or --vm, instead of linking
+# them.
+PCCRUN=
+
+cc -shared -fPIC -o libtest.so test.c
+
 assert() {
   expected="$1"
   input="$2"
 
-  ./pcc "$input" > tmp.s
-  cc -o tmp tmp.s
-  ./tmp
-  actual="$?"
+  if [[ -n "$PCCRUN" ]]; then
+    echo "$input" | ./pcc $PCCFLAGS $PCCRUN -
+    actual="$?"
+  else
+    echo "$input" | ./pcc $PCCFLAGS -o $PCCOUT -
+    cc -o tmp $PCCOUT
+    ./tmp
+    actual="$?"
+  fi
 
   if [[ "$actual" = "$expected" ]]; then
     echo "$input => $actual"
@@ -21,11 +38,16 @@ assert_funcall() {
   expected="$1"
   input="$2"
 
-  cc -c test.c
-  ./pcc "$input" > tmp.s
-  cc -o tmp tmp.s test.o
-  ./tmp
-  actual="$?"
+  if [[ -n "$PCCRUN" ]]; then
+    echo "$input" | ./pcc $PCCFLAGS $PCCRUN --load ./libtest.so -
+    actual="$?"
+  else
+    cc -c test.c
+    echo "$input" | ./pcc $PCCFLAGS -o $PCCOUT -
+    cc -o tmp $PCCOUT test.o
+    ./tmp
+    actual="$?"
+  fi
 
   if [[ "$actual" = "$expected" ]]; then
     echo "$input => $actual"
@@ -35,65 +57,184 @@ assert_funcall() {
   fi
 }
 
-assert 0 "0;"
-assert 42 "42;"
-assert 21 "5+20-4;"
-assert 41 " 12 + 34 - 5 ;"
-assert 47 '5+6*7;'
-assert 15 '5*(9-6);'
-assert 4 '(3+5)/2;'
-assert 42 "+42;"
-assert 42 "+2*+3*+7;"
-assert 42 "-(-42);"
-assert 42 "-(-(-(-42));"
-assert 42 "-6*-7;"
-assert 42 "-2 * +3 * -7;"
-assert 1 "42==42;"
-assert 0 "42!=42;"
-assert 0 "42<42;"
-assert 1 "42<=42;"
-assert 0 "42>42;"
-assert 1 "42<=42;"
-assert 1 "1 * 2 * 3 * 7 == 42;"
-assert 1 "6 * 7 == -7 * (-6);"
-assert 1 "1 * 2 * 3 * 7 == 42;"
-assert 1 "(44 - 20 * 3 / 2) * 3 == 42;"
-assert 1 "(42!=42)==0;"
-assert 1 "42!=42==0;"
-assert 42 "a=42;"
-assert 42 "a=b=c=d=e=f=g=h=i=j=k=l=m=n=o=p=q=r=s=t=u=v=w=x=y=z=42;"
-assert 1 "a=0; b=1;"
-assert 25 "a=0;b=1;c=2;d=3;e=4;f=5;g=6;h=7;i=8;j=9;k=10;l=11;m=12;n=13;o=14;p=15;q=16;r=17;s=18;t=19;u=20;v=21;w=22;x=23;y=24;z=25;"
-assert 1 "a=0;a+1;"
-assert 25 "a=0;b=a+1;c=b+1;d=c+1;e=d+1;f=e+1;g=f+1;h=g+1;i=h+1;j=i+1;k=j+1;l=k+1;m=l+1;n=m+1;o=n+1;p=o+1;q=p+1;r=q+1;s=r+1;t=s+1;u=t+1;v=u+1;w=v+1;x=w+1;y=x+1;z=y+1;"
-assert 3 "a = 1; b = 2; c = a + b;"
-assert 42 "a=1; b=2; c=3; d=7; a*b*c*d;"
-assert 6 "foo = 1; bar = 2 + 3; foo + bar;"
-assert 0 "variablewithlongname = 1; anothervariablewithyetlongname = -1; variablewithlongname + anothervariablewithyetlongname;"
-assert 42 "a1ph4numname = 42; a1ph4numname;"
-assert 42 "foo_bar = 21; baz_ = 2; quxx = foo_bar * baz_;"
-assert 0 "return 0;"
-assert 42 "return 42;"
-assert 3 "a = 1; b = 2; return a+b;"
-assert 42 "if (1) 42;"
-assert 42 "if (0) 1; else 42;"
-assert 42 "a = 0; b = 0; if (a == b) 42; else 1;"
-assert 42 "a = 0; b = 0; if (a < b) 1; else 42;"
-assert 10 "a = 0; while (a < 10) a = a + 1; a;"
-assert 0 "a = 10; while (a > 0) a = a - 1; a;"
-assert 20 "a = 0; for (i = 0; i < 10; i = i + 1) a = a + 2; a;"
-assert 0 "a = 10; for (i = 0; i < 10; i = i + 1) a = a - 1; a;"
-assert 0 "a = 0; for (i = 0; i < 0;)  a = a + 1; a;"
-assert 10 "i = 0; for (;i < 10;) i = i + 1; i;"
-assert 42 "{ return 42; }"
-assert 1 "{ a = 0; b = 1; return (a + b); }"
-assert 42 "if (0 < 1) { a = 42; return a; } else { return 1; }"
-assert 89 "a = 0; b = 1; for (i = 0; i < 10; i = i + 1) { tmp = b; b = a + b; a = tmp; } b;"
-assert 42 "{{{{{ return 42; }}}}}"
-
-assert_funcall 42 "foo();"
-assert_funcall 1 "bar(0, 1);"
-assert_funcall 14 "bar(1*2, 3*4);"
-assert_funcall 42 "bar(3*7, -3*(-7));"
+run_tests() {
+  assert 0 "0;"
+  assert 42 "42;"
+  assert 21 "5+20-4;"
+  assert 41 " 12 + 34 - 5 ;"
+  assert 47 '5+6*7;'
+  assert 15 '5*(9-6);'
+  assert 4 '(3+5)/2;'
+  assert 42 "+42;"
+  assert 42 "+2*+3*+7;"
+  assert 42 "-(-42);"
+  assert 42 "-(-(-(-42));"
+  assert 42 "-6*-7;"
+  assert 42 "-2 * +3 * -7;"
+  assert 36 "a = 3; a * 12;"
+  assert 31 "a = 3; a * -75;"
+  assert 4 "a = 30; a / 7;"
+  assert 252 "a = -30; a / 7;"
+  assert 254 "a = -23; a / 8;"
+  assert 3 "a = -23; a / -7;"
+  assert 1 "42==42;"
+  assert 0 "42!=42;"
+  assert 0 "42<42;"
+  assert 1 "42<=42;"
+  assert 0 "42>42;"
+  assert 1 "42<=42;"
+  assert 1 "1 * 2 * 3 * 7 == 42;"
+  assert 1 "6 * 7 == -7 * (-6);"
+  assert 1 "1 * 2 * 3 * 7 == 42;"
+  assert 1 "(44 - 20 * 3 / 2) * 3 == 42;"
+  assert 1 "(42!=42)==0;"
+  assert 1 "42!=42==0;"
+  assert 42 "a=42;"
+  assert 42 "a=b=c=d=e=f=g=h=i=j=k=l=m=n=o=p=q=r=s=t=u=v=w=x=y=z=42;"
+  assert 1 "a=0; b=1;"
+  assert 25 "a=0;b=1;c=2;d=3;e=4;f=5;g=6;h=7;i=8;j=9;k=10;l=11;m=12;n=13;o=14;p=15;q=16;r=17;s=18;t=19;u=20;v=21;w=22;x=23;y=24;z=25;"
+  assert 1 "a=0;a+1;"
+  assert 25 "a=0;b=a+1;c=b+1;d=c+1;e=d+1;f=e+1;g=f+1;h=g+1;i=h+1;j=i+1;k=j+1;l=k+1;m=l+1;n=m+1;o=n+1;p=o+1;q=p+1;r=q+1;s=r+1;t=s+1;u=t+1;v=u+1;w=v+1;x=w+1;y=x+1;z=y+1;"
+  assert 3 "a = 1; b = 2; c = a + b;"
+  assert 42 "a=1; b=2; c=3; d=7; a*b*c*d;"
+  assert 6 "foo = 1; bar = 2 + 3; foo + bar;"
+  assert 0 "variablewithlongname = 1; anothervariablewithyetlongname = -1; variablewithlongname + anothervariablewithyetlongname;"
+  assert 42 "a1ph4numname = 42; a1ph4numname;"
+  assert 42 "foo_bar = 21; baz_ = 2; quxx = foo_bar * baz_;"
+  assert 1 "ab = 1; a = 2; ab;"
+  assert 0 "return 0;"
+  assert 42 "return 42;"
+  assert 3 "a = 1; b = 2; return a+b;"
+  assert 42 "if (1) 42;"
+  assert 42 "if (0) 1; else 42;"
+  assert 42 "a = 0; b = 0; if (a == b) 42; else 1;"
+  assert 42 "a = 0; b = 0; if (a < b) 1; else 42;"
+  assert 42 "a = 0; b = 1; if (a != b) 42; else 1;"
+  assert 42 "a = 1; b = 1; if (a <= b) 42; else 1;"
+  assert 42 "a = 2; b = 1; if (a >= b) 42; else 1;"
+  assert 42 "a = 1; b = 1; if (a > b) 1; else 42;"
+  assert 10 "a = 0; while (a < 10) a = a + 1; a;"
+  assert 0 "a = 10; while (a > 0) a = a - 1; a;"
+  assert 20 "a = 0; for (i = 0; i < 10; i = i + 1) a = a + 2; a;"
+  assert 0 "a = 10; for (i = 0; i < 10; i = i + 1) a = a - 1; a;"
+  assert 0 "a = 0; for (i = 0; i < 0;)  a = a + 1; a;"
+  assert 10 "i = 0; for (;i < 10;) i = i + 1; i;"
+  assert 7 "a = 7; while (a < 5) a = a + 1; a;"
+  assert 42 "a = 0; for (;;) { a = a + 6; if (a == 42) return a; }"
+  assert 12 "a = 0; i = 0; while (i < 3) { j = 0; while (j < 4) { a = a + 1; j = j + 1; } i = i + 1; } a;"
+  assert 3 "s = 0; for (i = 0; i < 3; i = i + 1) for (j = 0; j < i; j = j + 1) s = s + 1; s;"
+  assert 42 "{ return 42; }"
+  assert 1 "{ a = 0; b = 1; return (a + b); }"
+  assert 42 "if (0 < 1) { a = 42; return a; } else { return 1; }"
+  assert 89 "a = 0; b = 1; for (i = 0; i < 10; i = i + 1) { tmp = b; b = a + b; a = tmp; } b;"
+  assert 42 "{{{{{ return 42; }}}}}"
+  assert 40 "1+(2+(3+(4+(5+(6+(7+(8+(9-(1-(2-(3-(4-(5-(6-(7-(8-(9-0)))))))))))))))));"
+  assert 45 "a=1;b=2;c=3;d=4;e=5;f=6;g=7;h=8;i=9; a+(b+(c+(d+(e+(f+(g+(h+i)))))));"
+  assert 7 "a=5; a*0+a*1+0+2;"
+  assert 5 "a=3; b=a-a; (a+1)+2-1+b;"
+  assert 6 "a=3; 0-(0-a)*1*2;"
+  assert 2 "a=7; 0*(a=2)+a;"
+  assert 1 "a=3; (a*2)*3 == 18;"
+  assert 3 "a = 1; if (a) { if (0) 1; else 2; } else 4; if (a == 1) { if (a) 3; } else 5;"
+  assert 3 "a = 0; { a = a + 1; } { a = a + 2; } a;"
+  assert 7 "a = 7; if (0) { a = 1; a = 2; } while (0) a = 3; for (i = 0; 0;) a = 4; a;"
+  assert 2 "a = 2; if (1) { return a; } a = 9; a;"
+  assert 5 "a = 0; while (a < 9) { a = a + 1; if (a < 4) a = a + 1; else { return a; a = 8; } }"
+  assert 0 "a = 5; if (a == 1) 2;"
+  assert 2 "a = 1; if (a == 1) 2;"
+  assert 0 "a = 0; while (a < 3) a = a + 1;"
+  assert 0 "a = 0; for (i = 0; i < 3; i = i + 1) a = a + 1;"
+  assert 0 "a = 7; {}"
+  assert 7 "a = 7; { a; }"
+  assert 1 "a = 5; 3 < a;"
+  assert 0 "a = 3; 3 < a;"
+  assert 1 "a = 3; 3 <= a;"
+  assert 42 "a = 2; if (a >= 3) 1; else 42;"
+  assert 3 "a = 0; while (3 > a) a = a + 1; a;"
+
+  assert_funcall 42 "foo();"
+  assert_funcall 1 "bar(0, 1);"
+  assert_funcall 14 "bar(1*2, 3*4);"
+  assert_funcall 42 "bar(3*7, -3*(-7));"
+  assert_funcall 50 "a = 4; a + (4 + bar(foo(), bar(1, 1) - 2));"
+  assert_funcall 42 "1+(2+(3+(4+(5+(6+(7+(8+bar(3, 3))))))));"
+  assert_funcall 14 "return bar(1*2, 3*4);"
+  assert_funcall 42 "a = 1; if (a) return foo(); 0;"
+  assert_funcall 7 "a = 3; b = 4; bar(a, b);"
+  assert_funcall 204 "sum8(1, 2, 3, 4, 5, 6, 7, 8);"
+  assert_funcall 38 "a = 1; b = 2; sum8(b, a, a + 1, 0, b - a, 0, a, b);"
+  assert_funcall 12 "a = 1; b = 2; bar(b + a, bar(a, b) * 3);"
+  assert_funcall 54 "a = 2; sum8(bar(a, 1), 0, 0, 0, 0, 0, b = 5, a);"
+  assert_funcall 1 "aligned();"
+  assert_funcall 4 "a = 1; b = 2; bar(b + a, aligned());"
+  assert_funcall 36 "1+(2+(3+(4+(5+(6+(7+(7+aligned())))))));"
+  assert_funcall 37 "1+(2+(3+(4+(5+(6+(7+(8+(aligned()))))))));"
+  assert_funcall 1 "a = 1; sum8(a, 0, 0, 0, 0, 0, 0, aligned()) == 9;"
+}
+
+run_tests
+PCCFLAGS=--ir run_tests
+PCCFLAGS=-c PCCOUT=tmp.o run_tests
+PCCFLAGS="-c --ir" PCCOUT=tmp.o run_tests
+PCCRUN=--run run_tests
+PCCFLAGS=--ir PCCRUN=--run run_tests
+PCCRUN=--vm run_tests
+
+# The native backends pass any number of the arguments while the VM passes at
+# most 8 of them.
+PCCRUN=--run assert_funcall 45 "nine(1, 2, 3, 4, 5, 6, 7, 8, 9);"
+PCCFLAGS=--ir PCCRUN=--run assert_funcall 45 "nine(1, 2, 3, 4, 5, 6, 7, 8, 9);"
+if ! echo "nine(1, 2, 3, 4, 5, 6, 7, 8, 9);" |
+    ./pcc --vm --load ./libtest.so - 2>&1 | grep -q "More than 8 arguments"; then
+  echo "--vm doesn't reject the call with more than 8 arguments"
+  exit 1
+fi
+# The registers of the VM are indexed by 16bit fields.
+if ! (for i in $(seq 0 65536); do echo "v$i = v0;"; done) |
+    ./pcc --vm - 2>&1 | grep -q "Too many registers"; then
+  echo "--vm doesn't reject more than 65536 local variables"
+  exit 1
+fi
+
+if ! echo "a = 1;" | ./pcc --time-report -o tmp.s - 2>&1 | grep -q "^codegen"; then
+  echo "--time-report doesn't report the phases"
+  exit 1
+fi
+if ! echo "a = 1;" | ./pcc --mem-report -o tmp.s - 2>&1 | grep -q "^Node  *3 "; then
+  echo "--mem-report doesn't report the nodes"
+  exit 1
+fi
+if ! echo "a = 1;" | ./pcc --mem-report -o tmp.s - 2>&1 | grep -q "^Token  *5 "; then
+  echo "--mem-report doesn't report the tokens"
+  exit 1
+fi
+echo "a = 3; b = a * 4;" > tmp-a.pcc
+echo "c = 5; if (c < 6) c = 7; c;" > tmp-b.pcc
+./pcc -j 2 tmp-a.pcc tmp-b.pcc
+for f in tmp-a tmp-b; do
+  ./pcc -o tmp.s $f.pcc
+  if ! cmp -s tmp.s $f.s; then
+    echo "The batch compilation of $f.pcc differs from the single one"
+    exit 1
+  fi
+done
+if echo "if (0) 1; else 2; while (0) 3;" | ./pcc - | grep -q "^.L"; then
+  echo "The dead code and the unused labels are not removed"
+  exit 1
+fi
+# x > 3 is parsed as 3 < x and canonicalized to !(x <= 3), which the branch is
+# fused with.
+if ! echo "x = 5; if (x > 3) 1;" | ./pcc - | grep -q "cmp .*, 3$"; then
+  echo "The comparison with the constant on the lhs is not canonicalized"
+  exit 1
+fi
+if ! echo "x = 5; 3 <= x;" | ./pcc --dump-ir - | grep -q "v2 < v3"; then
+  echo "The comparison with the constant on the lhs is not negated"
+  exit 1
+fi
+if ! echo "a = 1; a + 2;" | ./pcc --dump-bc - | grep -q "addi	r1, r0, 2"; then
+  echo "--dump-bc doesn't print the bytecode"
+  exit 1
+fi
 
 echo OK
@@ -1,34 +1,146 @@
 #include "pcc.h"
 
+// The initial capacity of the array of the tokens.
+#define INIT_TOKENS 1024
+
+// The classes of the characters which determine how the tokenizer scans the
+// token starting with the character.
+enum {
+  CH_INVALID = 0,  // Cannot start any token
+  CH_SPACE,        // White space to be skipped
+  CH_ALPHA,        // Alphabet or '_', which starts an identifier or a keyword
+  CH_DIGIT,        // Digit, which starts a number
+  CH_PUNCT,        // Single character operator
+  CH_CMP,          // Operator which may be followed by '='
+};
+
+// The character class table indexed by the character.
+static const unsigned char char_class[256] = {
+  [' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE,
+  ['\v'] = CH_SPACE, ['\f'] = CH_SPACE, ['\r'] = CH_SPACE,
+  ['a'] = CH_ALPHA, ['b'] = CH_ALPHA, ['c'] = CH_ALPHA, ['d'] = CH_ALPHA,
+  ['e'] = CH_ALPHA, ['f'] = CH_ALPHA, ['g'] = CH_ALPHA, ['h'] = CH_ALPHA,
+  ['i'] = CH_ALPHA, ['j'] = CH_ALPHA, ['k'] = CH_ALPHA, ['l'] = CH_ALPHA,
+  ['m'] = CH_ALPHA, ['n'] = CH_ALPHA, ['o'] = CH_ALPHA, ['p'] = CH_ALPHA,
+  ['q'] = CH_ALPHA, ['r'] = CH_ALPHA, ['s'] = CH_ALPHA, ['t'] = CH_ALPHA,
+  ['u'] = CH_ALPHA, ['v'] = CH_ALPHA, ['w'] = CH_ALPHA, ['x'] = CH_ALPHA,
+  ['y'] = CH_ALPHA, ['z'] = CH_ALPHA,
+  ['A'] = CH_ALPHA, ['B'] = CH_ALPHA, ['C'] = CH_ALPHA, ['D'] = CH_ALPHA,
+  ['E'] = CH_ALPHA, ['F'] = CH_ALPHA, ['G'] = CH_ALPHA, ['H'] = CH_ALPHA,
+  ['I'] = CH_ALPHA, ['J'] = CH_ALPHA, ['K'] = CH_ALPHA, ['L'] = CH_ALPHA,
+  ['M'] = CH_ALPHA, ['N'] = CH_ALPHA, ['O'] = CH_ALPHA, ['P'] = CH_ALPHA,
+  ['Q'] = CH_ALPHA, ['R'] = CH_ALPHA, ['S'] = CH_ALPHA, ['T'] = CH_ALPHA,
+  ['U'] = CH_ALPHA, ['V'] = CH_ALPHA, ['W'] = CH_ALPHA, ['X'] = CH_ALPHA,
+  ['Y'] = CH_ALPHA, ['Z'] = CH_ALPHA,
+  ['_'] = CH_ALPHA,
+  ['0'] = CH_DIGIT, ['1'] = CH_DIGIT, ['2'] = CH_DIGIT, ['3'] = CH_DIGIT,
+  ['4'] = CH_DIGIT, ['5'] = CH_DIGIT, ['6'] = CH_DIGIT, ['7'] = CH_DIGIT,
+  ['8'] = CH_DIGIT, ['9'] = CH_DIGIT,
+  ['+'] = CH_PUNCT, ['-'] = CH_PUNCT, ['*'] = CH_PUNCT, ['/'] = CH_PUNCT,
+  ['('] = CH_PUNCT, [')'] = CH_PUNCT, ['{'] = CH_PUNCT, ['}'] = CH_PUNCT,
+  [';'] = CH_PUNCT, [','] = CH_PUNCT,
+  ['<'] = CH_CMP, ['>'] = CH_CMP, ['='] = CH_CMP, ['!'] = CH_CMP,
+};
+
+// The kinds of the operator tokens indexed by their first character. The
+// operators of CH_CMP followed by '=' have the next kind.
+static const unsigned char op_kind[256] = {
+  ['+'] = TK_PLUS, ['-'] = TK_MINUS, ['*'] = TK_STAR, ['/'] = TK_SLASH,
+  ['('] = TK_LPAREN, [')'] = TK_RPAREN, ['{'] = TK_LBRACE, ['}'] = TK_RBRACE,
+  [';'] = TK_SEMI, [','] = TK_COMMA,
+  ['<'] = TK_LT, ['>'] = TK_GT, ['='] = TK_ASSIGN, ['!'] = TK_NOT,
+};
+
+// The strings of the operators and the keywords indexed by their kinds.
+static const char *token_strs[] = {
+  [TK_PLUS] = "+", [TK_MINUS] = "-", [TK_STAR] = "*", [TK_SLASH] = "/",
+  [TK_LPAREN] = "(", [TK_RPAREN] = ")", [TK_LBRACE] = "{", [TK_RBRACE] = "}",
+  [TK_SEMI] = ";", [TK_COMMA] = ",", [TK_ASSIGN] = "=", [TK_EQ] = "==",
+  [TK_NOT] = "!", [TK_NE] = "!=", [TK_LT] = "<", [TK_LE] = "<=",
+  [TK_GT] = ">", [TK_GE] = ">=", [TK_IF] = "if", [TK_ELSE] = "else",
+  [TK_WHILE] = "while", [TK_FOR] = "for", [TK_RETURN] = "return",
+};
+
 /*
- * Examines if the character is an alphabet or '_'.
+ * Returns the class of the character.
  */
-static inline bool isalphau(char c) {
-  return isalpha(c) || c == '_';
+static inline int char_class_of(char c) {
+  return char_class[(unsigned char)c];
 }
 
 /*
  * Examines if the character is an alphabet, a number or '_'.
  */
 static inline bool isalnumu(char c) {
-  return isalnum(c) || c == '_';
+  int cls = char_class_of(c);
+  return cls == CH_ALPHA || cls == CH_DIGIT;
+}
+
+/*
+ * Returns the kind of the token for the scanned identifier.
+ *
+ * Every keyword has a distinct length, so the length works as a perfect hash
+ * and at most one comparison is done per identifier.
+ */
+static TokenKind keyword_kind(const char *p, int len) {
+  TokenKind kind;
+
+  switch (len) {
+    case 2:
+      kind = TK_IF;
+      break;
+    case 3:
+      kind = TK_FOR;
+      break;
+    case 4:
+      kind = TK_ELSE;
+      break;
+    case 5:
+      kind = TK_WHILE;
+      break;
+    case 6:
+      kind = TK_RETURN;
+      break;
+    default:
+      return TK_IDENT;
+  }
+
+  return memcmp(p, token_strs[kind], len) ? TK_IDENT : kind;
 }
 
 /**
- * Report an error.
+ * Report an error with the line of the input where it is found.
  *
  * This function takes the same arguments as printf.
  *
+ * @param c   the context of the compilation
  * @param loc the error location in the input
  * @param fmt the format string
  * @param ... the parameters to be used for the formatting
  */
-void error_at(char *loc, char *fmt, ...) {
+void error_at(Context *c, char *loc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
 
-  int pos = loc - user_input;
-  fprintf(stderr, "%s\n", user_input);
+  // Find the line containing the location.
+  char *line = loc;
+  while (c->user_input < line && line[-1] != '\n') {
+    line--;
+  }
+  char *end = loc;
+  while (*end && *end != '\n') {
+    end++;
+  }
+  int line_no = 1;
+  for (char *p = c->user_input; p < line; p++) {
+    if (*p == '\n') {
+      line_no++;
+    }
+  }
+
+  int indent = fprintf(stderr, "%s:%d: ", c->input_path, line_no);
+  fprintf(stderr, "%.*s\n", (int)(end - line), line);
+  int pos = loc - line + indent;
   fprintf(stderr, "%*s", pos, "");
   fprintf(stderr, "^ ");
   vfprintf(stderr, fmt, ap);
@@ -40,19 +152,18 @@ void error_at(char *loc, char *fmt, ...) {
 /**
  * Consume a token
  *
- * If the next token is the expected operator, scan a token and return true.
- * Otherwise return false.
+ * If the next token is the expected operator or keyword, scan a token and
+ * return true. Otherwise return false.
  *
- * @param op the pointer to the operator string
+ * @param c    the context of the compilation
+ * @param kind the kind of the expected token
  * @return true if the next token is the expected operator, otherwise false
  */
-bool consume(char *op) {
-  if ((token->kind != TK_RESERVED && token->kind != TK_RETURN) ||
-      strlen(op) != token->len ||
-      memcmp(token->str, op, token->len)) {
+bool consume(Context *c, TokenKind kind) {
+  if (c->token->kind != kind) {
     return false;
   }
-  token = token->next;
+  c->token++;
 
   return true;
 }
@@ -63,35 +174,32 @@ bool consume(char *op) {
  * If the next token is an identifier, scan a token and return the node
  * constructed for the identifier.
  *
+ * @param c the context of the compilation
  * @return the current identifier token
  */
-Token *consume_ident() {
-  if (token->kind != TK_IDENT ||
-      token->len < 1) {
+Token *consume_ident(Context *c) {
+  if (c->token->kind != TK_IDENT ||
+      c->token->len < 1) {
     return NULL;
   }
 
-  Token *cur = token;
-  token = token->next;
-
-  return cur;
+  return c->token++;
 }
 
 /**
  * Expects a valid token
  *
- * If the next token is the expected string, scan a token. Otherwise report the
- * error.
+ * If the next token is the expected operator or keyword, scan a token.
+ * Otherwise report the error.
  *
- * @param op the pointer to the expected string
+ * @param c    the context of the compilation
+ * @param kind the kind of the expected token
  */
-void expect(char *op) {
-  if (token->kind != TK_RESERVED ||
-      strlen(op) != token->len ||
-      memcmp(token->str, op, token->len)) {
-    error_at(token->str, "expected \"%s\"", op);
+void expect(Context *c, TokenKind kind) {
+  if (c->token->kind != kind) {
+    error_at(c, c->token->str, "expected \"%s\"", token_strs[kind]);
   }
-  token = token->next;
+  c->token++;
 }
 
 /**
@@ -100,126 +208,112 @@ void expect(char *op) {
  * If the token is a number, scan a token and return its value. Otherwise report
  * the error.
  *
+ * @param c the context of the compilation
  * @return the value of the number token if the next token is a number
  */
-int expect_number() {
-  if (token->kind != TK_NUM) {
-    error_at(token->str, "Not a number");
+int expect_number(Context *c) {
+  if (c->token->kind != TK_NUM) {
+    error_at(c, c->token->str, "Not a number");
   }
-  int val = token->val;
-  token = token->next;
-
-  return val;
+  return c->token++->val;
 }
 
 /**
  * Examine if it is EOF
  *
+ * @param c the context of the compilation
  * @return true if it is EOF, otherwise false
  */
-bool at_eof() {
-  return token->kind == TK_EOF;
+bool at_eof(Context *c) {
+  return c->token->kind == TK_EOF;
 }
 
 /*
- * Create a new token and chain it to the curernt token
+ * Create a new token at the end of the array of the context, which is grown
+ * by doubling leaving the old one in the arena.
  *
+ * @param c    the context of the compilation
  * @param kind the kind of the token to create
- * @param cur  the pointer to the current token
  * @param str  the token string
  * @param len  the length of the token string
  * @return the pointer to the created token
  */
-static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-  Token *tok = calloc(1, sizeof(Token));
+static Token *new_token(Context *c, TokenKind kind, char *str, int len) {
+  if (c->num_tokens == c->cap_tokens) {
+    int cap = c->cap_tokens * 2;
+    Token *toks = arena_alloc_block(c, MEM_TOKEN, sizeof(Token) * cap);
+    memcpy(toks, c->tokens, sizeof(Token) * c->num_tokens);
+    c->tokens = toks;
+    c->cap_tokens = cap;
+  }
+
+  arena_count(c, MEM_TOKEN);
+  Token *tok = &c->tokens[c->num_tokens++];
   tok->kind = kind;
   tok->str = str;
   tok->len = len;
-  cur->next = tok;
 
   return tok;
 }
 
 /**
- * Tokenize the input string
+ * Tokenize the input of the context into its array of the tokens, and make
+ * the first token current.
+ *
+ * The operators and the keywords are classified into their kinds here, so
+ * that the parser compares them as integers.
  *
- * @param p the pointer to the input string
- * @return the token tokenized from the input string
+ * @param c the context of the compilation
  */
-Token *tokenize(char *p) {
-  Token head;
-  head.next = NULL;
-  Token *cur = &head;
+void tokenize(Context *c) {
+  char *p = c->user_input;
+  // Start small and grow by doubling rather than scanning the input for its
+  // length first.
+  c->cap_tokens = INIT_TOKENS;
+  c->tokens = arena_alloc_block(c, MEM_TOKEN, sizeof(Token) * c->cap_tokens);
+  c->num_tokens = 0;
 
   while (*p) {
-    // Skip the white spaces.
-    if (isspace(*p)) {
-      p++;
-      continue;
-    }
-
-    if (!strncmp(p, "if", 2) && !isalnumu(p[2])) {
-      cur = new_token(TK_RESERVED, cur, p, 2);
-      p += 2;
-      continue;
-    }
-
-    if (!strncmp(p, "else", 4) && !isalnumu(p[4])) {
-      cur = new_token(TK_RESERVED, cur, p, 4);
-      p += 4;
-      continue;
-    }
-
-    if (!strncmp(p, "while", 5) && !isalnumu(p[5])) {
-      cur = new_token(TK_RESERVED, cur, p, 5);
-      p += 5;
-      continue;
-    }
-
-    if (!strncmp(p, "for", 3) && !isalnumu(p[3])) {
-      cur = new_token(TK_RESERVED, cur, p, 3);
-      p += 3;
-      continue;
-    }
-
-    if (!strncmp(p, "return", 6) && !isalnumu(p[6])) {
-      cur = new_token(TK_RETURN, cur, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (isalphau(*p)) {
-      int vlen = 1;
-      while (isalnumu(*(p+vlen))) {
-        vlen++;
+    switch (char_class_of(*p)) {
+      case CH_SPACE:
+        // Skip the white spaces.
+        p++;
+        continue;
+      case CH_ALPHA: {
+        // Scan the identifier and then look it up in the keywords.
+        int len = 1;
+        while (isalnumu(p[len])) {
+          len++;
+        }
+        new_token(c, keyword_kind(p, len), p, len);
+        p += len;
+        continue;
       }
-      cur = new_token(TK_IDENT, cur, p, vlen);
-      p += vlen;
-      continue;
-    }
-
-    if (strchr("+-*/()<>{}=!;,", *p)) {
-      if ((*p == '=' || *p == '!' || *p == '<' || *p == '>') && *(p+1) == '=') {
-        cur = new_token(TK_RESERVED, cur, p, 2);
-        p += 2;
-      } else {
-        cur = new_token(TK_RESERVED, cur, p++, 1);
+      case CH_DIGIT: {
+        char *start = p;
+        unsigned int val = 0;
+        while (char_class_of(*p) == CH_DIGIT) {
+          val = val * 10 + (*p++ - '0');
+        }
+        new_token(c, TK_NUM, start, p - start)->val = val;
+        continue;
       }
-      continue;
+      case CH_CMP:
+        if (p[1] == '=') {
+          new_token(c, op_kind[(unsigned char)*p] + 1, p, 2);
+          p += 2;
+          continue;
+        }
+        // Fall through to the single character operator.
+      case CH_PUNCT:
+        new_token(c, op_kind[(unsigned char)*p], p, 1);
+        p++;
+        continue;
     }
 
-    if (isdigit(*p)) {
-      const char *start = p;
-      int val = strtol(p, &p, 10);
-      cur = new_token(TK_NUM, cur, p, p - start);
-      cur->val = val;
-      continue;
-    }
-
-    error_at(cur->str, "Cannot tokenize");
+    error_at(c, p, "Cannot tokenize");
   }
 
-  new_token(TK_EOF, cur, p, 0);
-
-  return head.next;
+  new_token(c, TK_EOF, p, 0);
+  c->token = c->tokens;
 }
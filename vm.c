@@ -0,0 +1,549 @@
+#include "pcc.h"
+
+// The maximum number of the arguments of the native functions.
+#define MAX_ARGS 8
+
+// The maximum number of the registers, which are indexed by 16bit fields.
+#define MAX_REGS 65536
+
+/*
+ * The state of the compilation of a function to the bytecode
+ */
+typedef struct {
+  // The context of the compilation.
+  Context *c;
+  // The function being compiled.
+  BcFunc *fn;
+  // The AST of the function being compiled.
+  const Ast *ast;
+  // The number of the registers for the local variables.
+  int num_locals;
+  // The number of the live temporaries, which are allocated like a stack
+  // after the local variables.
+  int top;
+} Compiler;
+
+static void compile_stmt(Compiler *cp, NodeId node, bool tail);
+static int compile_expr(Compiler *cp, NodeId node);
+
+/*
+ * Appends the instruction and returns its index.
+ */
+static int add_bc(Compiler *cp, BcOp op, int a, int b, int c) {
+  if (cp->fn->len == cp->fn->cap) {
+    int cap = cp->fn->cap ? cp->fn->cap * 2 : 256;
+    BcInsn *code = arena_alloc(cp->c, MEM_INSN, sizeof(BcInsn) * cap);
+    if (cp->fn->len) {
+      memcpy(code, cp->fn->code, sizeof(BcInsn) * cp->fn->len);
+    }
+    cp->fn->code = code;
+    cp->fn->cap = cap;
+  }
+
+  cp->fn->code[cp->fn->len] = (BcInsn){ .op = op, .a = a, .b = b, .c = c };
+  return cp->fn->len++;
+}
+
+/*
+ * Exits if the number of the registers exceeds what the instructions can
+ * index.
+ */
+static void check_regs(int num_regs) {
+  if (num_regs > MAX_REGS) {
+    fprintf(stderr, "Too many registers for the bytecode.\n");
+    exit(1);
+  }
+}
+
+/*
+ * Allocates a new temporary register.
+ */
+static int new_reg(Compiler *cp) {
+  int reg = cp->num_locals + cp->top++;
+  check_regs(reg + 1);
+  if (reg >= cp->fn->num_regs) {
+    cp->fn->num_regs = reg + 1;
+  }
+
+  return reg;
+}
+
+/*
+ * Returns the register of the local variable, which is numbered in the node.
+ */
+static int lvar_reg(Compiler *cp, NodeId node) {
+  return cp->ast->val[node];
+}
+
+/*
+ * Examines if the evaluation of the expression assigns to a local variable.
+ */
+static bool has_assign(Compiler *cp, NodeId node) {
+  if (!node) {
+    return false;
+  }
+  if (cp->ast->kind[node] == ND_ASSIGN) {
+    return true;
+  }
+  if (cp->ast->kind[node] == ND_FUNCALL) {
+    for (NodeId arg = cp->ast->lhs[node]; arg; arg = cp->ast->next[arg]) {
+      if (has_assign(cp, arg)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (cp->ast->kind[node] == ND_NUM || cp->ast->kind[node] == ND_LVAR) {
+    return false;
+  }
+
+  return has_assign(cp, cp->ast->lhs[node]) ||
+      has_assign(cp, cp->ast->rhs[node]);
+}
+
+/*
+ * Compiles the function call. The arguments are evaluated into consecutive
+ * temporaries, the first of which receives the return value.
+ */
+static int compile_funcall(Compiler *cp, NodeId node) {
+  if (cp->ast->rhs[node] > MAX_ARGS) {
+    fprintf(stderr, "More than %d arguments are not supported by the VM.\n",
+            MAX_ARGS);
+    exit(-1);
+  }
+
+  int base = cp->top;
+  int first = cp->num_locals + base;
+  int n = 0;
+  for (NodeId arg = cp->ast->lhs[node]; arg; arg = cp->ast->next[arg]) {
+    int reg = compile_expr(cp, arg);
+    cp->top = base + n;
+    int dst = new_reg(cp);
+    if (reg != dst) {
+      add_bc(cp, BC_MOV, dst, reg, 0);
+    }
+    n++;
+  }
+
+  if (cp->fn->num_calls == cp->fn->cap_calls) {
+    int cap = cp->fn->cap_calls ? cp->fn->cap_calls * 2 : 16;
+    BcCall *calls = arena_alloc(cp->c, MEM_INSN, sizeof(BcCall) * cap);
+    if (cp->fn->num_calls) {
+      memcpy(calls, cp->fn->calls, sizeof(BcCall) * cp->fn->num_calls);
+    }
+    cp->fn->calls = calls;
+    cp->fn->cap_calls = cap;
+  }
+  cp->fn->calls[cp->fn->num_calls] = (BcCall){
+    .name = cp->ast->callees[cp->ast->val[node]], .nargs = n };
+
+  cp->top = base;
+  int dst = new_reg(cp);
+  add_bc(cp, BC_CALL, dst, first, cp->fn->num_calls++);
+
+  return dst;
+}
+
+/*
+ * Compiles the expression and returns the register holding its value. The
+ * local variables are read from their registers in place.
+ */
+static int compile_expr(Compiler *cp, NodeId node) {
+  switch (cp->ast->kind[node]) {
+    case ND_NUM: {
+      int dst = new_reg(cp);
+      add_bc(cp, BC_IMM, dst, 0, cp->ast->val[node]);
+      return dst;
+    }
+    case ND_LVAR:
+      return lvar_reg(cp, node);
+    case ND_ASSIGN: {
+      if (cp->ast->kind[cp->ast->lhs[node]] != ND_LVAR) {
+        error_at(cp->c, cp->c->token->str, "The left hand side of the assiment is not left value.");
+      }
+      int base = cp->top;
+      int src = compile_expr(cp, cp->ast->rhs[node]);
+      int dst = lvar_reg(cp, cp->ast->lhs[node]);
+      BcInsn *last = cp->fn->len ? &cp->fn->code[cp->fn->len - 1] : NULL;
+      if (src >= cp->num_locals && last && last->a == src &&
+          last->op != BC_JZ && last->op != BC_RET) {
+        // Let the instruction computing the temporary write the variable.
+        last->a = dst;
+      } else if (src != dst) {
+        add_bc(cp, BC_MOV, dst, src, 0);
+      }
+      cp->top = base;
+      return dst;
+    }
+    case ND_FUNCALL:
+      return compile_funcall(cp, node);
+  }
+
+  BcOp op;
+  switch (cp->ast->kind[node]) {
+    case ND_ADD:
+      op = BC_ADD;
+      break;
+    case ND_SUB:
+      op = BC_SUB;
+      break;
+    case ND_MUL:
+      op = BC_MUL;
+      break;
+    case ND_DIV:
+      op = BC_DIV;
+      break;
+    case ND_EQ:
+      op = BC_EQ;
+      break;
+    case ND_NE:
+      op = BC_NE;
+      break;
+    case ND_LT:
+      op = BC_LT;
+      break;
+    case ND_LE:
+      op = BC_LE;
+      break;
+    default:
+      error_at(cp->c, cp->c->token->str, "Not an expression.");
+  }
+
+  int base = cp->top;
+  NodeId rhs = cp->ast->rhs[node];
+  int lhs = compile_expr(cp, cp->ast->lhs[node]);
+  // The local variable read in place has to be copied if the rhs assigns to
+  // it before the operation reads it.
+  if (lhs < cp->num_locals && has_assign(cp, rhs)) {
+    int tmp = new_reg(cp);
+    add_bc(cp, BC_MOV, tmp, lhs, 0);
+    lhs = tmp;
+  }
+
+  // Add and subtract the constants as the immediates.
+  if (cp->ast->kind[rhs] == ND_NUM && (op == BC_ADD || op == BC_SUB) &&
+      cp->ast->val[rhs] != -2147483647 - 1) {
+    cp->top = base;
+    int dst = new_reg(cp);
+    int imm = cp->ast->val[rhs];
+    add_bc(cp, BC_ADDI, dst, lhs, op == BC_ADD ? imm : -imm);
+    return dst;
+  }
+
+  int rhs_reg = compile_expr(cp, rhs);
+  // The operands are read before the result is written, so the result can
+  // reuse their temporaries.
+  cp->top = base;
+  int dst = new_reg(cp);
+  add_bc(cp, op, dst, lhs, rhs_reg);
+
+  return dst;
+}
+
+/*
+ * Compiles the condition and returns the index of the jump taken when it is
+ * false, whose target is patched later.
+ */
+static int compile_cond(Compiler *cp, NodeId cond) {
+  int base = cp->top;
+  int reg = compile_expr(cp, cond);
+  cp->top = base;
+
+  return add_bc(cp, BC_JZ, reg, 0, 0);
+}
+
+/*
+ * Compiles the statement. The value of the expression statement in the tail
+ * position, after which the program ends, is returned like in the IR.
+ */
+static void compile_stmt(Compiler *cp, NodeId node, bool tail) {
+  int base = cp->top;
+
+  switch (cp->ast->kind[node]) {
+    case ND_IF: {
+      NodeId ebody = cp->ast->val[node];
+      int jz = compile_cond(cp, cp->ast->lhs[node]);
+      compile_stmt(cp, cp->ast->rhs[node], tail);
+      if (ebody) {
+        int jmp = add_bc(cp, BC_JMP, 0, 0, 0);
+        cp->fn->code[jz].c = cp->fn->len;
+        compile_stmt(cp, ebody, tail);
+        cp->fn->code[jmp].c = cp->fn->len;
+      } else {
+        cp->fn->code[jz].c = cp->fn->len;
+      }
+      return;
+    }
+    case ND_WHILE: {
+      int begin = cp->fn->len;
+      int jz = compile_cond(cp, cp->ast->lhs[node]);
+      compile_stmt(cp, cp->ast->rhs[node], false);
+      add_bc(cp, BC_JMP, 0, 0, begin);
+      cp->fn->code[jz].c = cp->fn->len;
+      return;
+    }
+    case ND_FOR: {
+      NodeId cond = cp->ast->lhs[node];
+      NodeId post = cp->ast->val[node];
+      NodeId body = cp->ast->rhs[node];
+      int begin = cp->fn->len;
+      int jz = cond ? compile_cond(cp, cond) : -1;
+      compile_stmt(cp, body, false);
+      if (post) {
+        compile_expr(cp, post);
+        cp->top = base;
+      }
+      add_bc(cp, BC_JMP, 0, 0, begin);
+      if (jz >= 0) {
+        cp->fn->code[jz].c = cp->fn->len;
+      }
+      return;
+    }
+    case ND_BLOCK:
+      for (NodeId cur = cp->ast->lhs[node]; cur; cur = cp->ast->next[cur]) {
+        compile_stmt(cp, cur, tail && !cp->ast->next[cur]);
+      }
+      return;
+    case ND_RETURN:
+      add_bc(cp, BC_RET, compile_expr(cp, cp->ast->lhs[node]), 0, 0);
+      cp->top = base;
+      return;
+  }
+
+  int reg = compile_expr(cp, node);
+  if (tail) {
+    add_bc(cp, BC_RET, reg, 0, 0);
+  }
+  cp->top = base;
+}
+
+/**
+ * Compiles the AST of the function to the bytecode.
+ *
+ * Like the native backends, the value of the expression statement in the
+ * tail position is returned and 0 is returned when the program falls off the
+ * end. The calls take at most MAX_ARGS arguments and the local variables and
+ * the temporaries fit in MAX_REGS registers, otherwise the compilation fails.
+ *
+ * @param c       the context of the compilation
+ * @param program the function to be compiled
+ * @return the compiled function
+ */
+BcFunc *bc_compile(Context *c, const Function *program) {
+  Compiler compiler = {
+    .c = c,
+    .fn = arena_alloc(c, MEM_INSN, sizeof(BcFunc)),
+    .ast = program->ast,
+    .num_locals = program->stack_size / 8,
+  };
+  Compiler *cp = &compiler;
+  // The local variables are indexed by the 16bit fields as well.
+  check_regs(cp->num_locals);
+  cp->fn->num_regs = cp->num_locals;
+
+  for (NodeId cur = program->node; cur; cur = cp->ast->next[cur]) {
+    compile_stmt(cp, cur, !cp->ast->next[cur]);
+  }
+
+  // Return 0 when the program falls off the end without a value.
+  int reg = new_reg(cp);
+  add_bc(cp, BC_IMM, reg, 0, 0);
+  add_bc(cp, BC_RET, reg, 0, 0);
+
+  return cp->fn;
+}
+
+// The names of the opcodes indexed by BcOp.
+static const char *bc_names[] = {
+  [BC_IMM] = "imm", [BC_MOV] = "mov", [BC_ADD] = "add", [BC_ADDI] = "addi",
+  [BC_SUB] = "sub", [BC_MUL] = "mul", [BC_DIV] = "div", [BC_EQ] = "eq",
+  [BC_NE] = "ne", [BC_LT] = "lt", [BC_LE] = "le", [BC_JMP] = "jmp",
+  [BC_JZ] = "jz", [BC_CALL] = "call", [BC_RET] = "ret",
+};
+
+/**
+ * Prints the bytecode in the human readable form into the output buffer.
+ *
+ * @param c  the context of the compilation
+ * @param fn the function to be printed
+ */
+void dump_bc(Context *c, const BcFunc *fn) {
+  emit(c, "; %d registers, %d instructions\n", fn->num_regs, fn->len);
+  for (int i = 0; i < fn->len; i++) {
+    const BcInsn *insn = &fn->code[i];
+    emit(c, "%d:\t%s\t", i, bc_names[insn->op]);
+    switch (insn->op) {
+      case BC_IMM:
+        emit(c, "r%d, %d\n", insn->a, insn->c);
+        break;
+      case BC_MOV:
+        emit(c, "r%d, r%d\n", insn->a, insn->b);
+        break;
+      case BC_ADDI:
+        emit(c, "r%d, r%d, %d\n", insn->a, insn->b, insn->c);
+        break;
+      case BC_JMP:
+        emit(c, "%d\n", insn->c);
+        break;
+      case BC_JZ:
+        emit(c, "r%d, %d\n", insn->a, insn->c);
+        break;
+      case BC_CALL: {
+        const BcCall *call = &fn->calls[insn->c];
+        emit(c, "r%d, %s", insn->a, call->name);
+        for (int j = 0; j < call->nargs; j++) {
+          emit(c, j ? ", r%d" : "(r%d", insn->b + j);
+        }
+        emit(c, call->nargs ? ")\n" : "()\n");
+        break;
+      }
+      case BC_RET:
+        emit(c, "r%d\n", insn->a);
+        break;
+      default:
+        emit(c, "r%d, r%d, r%d\n", insn->a, insn->b, insn->c);
+        break;
+    }
+  }
+}
+
+/*
+ * The native function called through the bridge. The registers are passed as
+ * longs, which the calling convention passes in the same way as ints.
+ */
+typedef long (*Native)();
+
+/*
+ * Calls the native function with the arguments.
+ */
+static long call_native(Native f, const long *args, int nargs) {
+  switch (nargs) {
+    case 0:
+      return f();
+    case 1:
+      return f(args[0]);
+    case 2:
+      return f(args[0], args[1]);
+    case 3:
+      return f(args[0], args[1], args[2]);
+    case 4:
+      return f(args[0], args[1], args[2], args[3]);
+    case 5:
+      return f(args[0], args[1], args[2], args[3], args[4]);
+    case 6:
+      return f(args[0], args[1], args[2], args[3], args[4], args[5]);
+    case 7:
+      return f(args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+    default:
+      return f(args[0], args[1], args[2], args[3], args[4], args[5], args[6],
+               args[7]);
+  }
+}
+
+// The dispatch of the interpreter. With GCC and Clang each handler jumps to
+// the next one through the table of the label addresses, which gives every
+// handler its own indirect branch to be predicted. Otherwise the handlers are
+// the cases of a switch in a loop.
+#ifdef __GNUC__
+#define VM_BEGIN() goto *dispatch[pc->op];
+#define VM_END()
+#define CASE(op) L_##op:
+#define NEXT() goto *dispatch[(++pc)->op]
+#define JUMP(target) goto *dispatch[(pc = code + (target))->op]
+#else
+#define VM_BEGIN() for (;;) { switch (pc->op) {
+#define VM_END() } }
+#define CASE(op) case op:
+#define NEXT() pc++; continue
+#define JUMP(target) pc = code + (target); continue
+#endif
+
+/**
+ * Runs the bytecode in the virtual machine.
+ *
+ * @param c the context of the compilation
+ * @param fn the function to be run
+ * @param libs the paths to the shared libraries the functions are looked up in
+ * @param num_libs the number of the libraries
+ * @return the value returned from the function
+ */
+int bc_run(Context *c, const BcFunc *fn, const char **libs, int num_libs) {
+  phase_begin(c, "link");
+  void **handles = load_libraries(c, libs, num_libs);
+  Native *natives =
+      arena_alloc(c, MEM_OTHER, sizeof(Native) * (fn->num_calls + 1));
+  for (int i = 0; i < fn->num_calls; i++) {
+    natives[i] = (Native)resolve_symbol(fn->calls[i].name, handles, num_libs);
+  }
+
+  phase_begin(c, "run");
+  long *r = arena_alloc(c, MEM_OTHER, sizeof(long) * (fn->num_regs + 1));
+  const BcInsn *code = fn->code;
+  const BcInsn *pc = code;
+  long result;
+
+#ifdef __GNUC__
+  static void *dispatch[] = {
+    [BC_IMM] = &&L_BC_IMM, [BC_MOV] = &&L_BC_MOV, [BC_ADD] = &&L_BC_ADD,
+    [BC_ADDI] = &&L_BC_ADDI, [BC_SUB] = &&L_BC_SUB, [BC_MUL] = &&L_BC_MUL,
+    [BC_DIV] = &&L_BC_DIV, [BC_EQ] = &&L_BC_EQ, [BC_NE] = &&L_BC_NE,
+    [BC_LT] = &&L_BC_LT, [BC_LE] = &&L_BC_LE, [BC_JMP] = &&L_BC_JMP,
+    [BC_JZ] = &&L_BC_JZ, [BC_CALL] = &&L_BC_CALL, [BC_RET] = &&L_BC_RET,
+  };
+#endif
+
+  VM_BEGIN()
+  CASE(BC_IMM)
+    r[pc->a] = pc->c;
+    NEXT();
+  CASE(BC_MOV)
+    r[pc->a] = r[pc->b];
+    NEXT();
+  CASE(BC_ADD)
+    r[pc->a] = r[pc->b] + r[pc->c];
+    NEXT();
+  CASE(BC_ADDI)
+    r[pc->a] = r[pc->b] + pc->c;
+    NEXT();
+  CASE(BC_SUB)
+    r[pc->a] = r[pc->b] - r[pc->c];
+    NEXT();
+  CASE(BC_MUL)
+    r[pc->a] = r[pc->b] * r[pc->c];
+    NEXT();
+  CASE(BC_DIV)
+    r[pc->a] = r[pc->b] / r[pc->c];
+    NEXT();
+  CASE(BC_EQ)
+    r[pc->a] = r[pc->b] == r[pc->c];
+    NEXT();
+  CASE(BC_NE)
+    r[pc->a] = r[pc->b] != r[pc->c];
+    NEXT();
+  CASE(BC_LT)
+    r[pc->a] = r[pc->b] < r[pc->c];
+    NEXT();
+  CASE(BC_LE)
+    r[pc->a] = r[pc->b] <= r[pc->c];
+    NEXT();
+  CASE(BC_JMP)
+    JUMP(pc->c);
+  CASE(BC_JZ)
+    if (!r[pc->a]) {
+      JUMP(pc->c);
+    }
+    NEXT();
+  CASE(BC_CALL)
+    r[pc->a] = call_native(natives[pc->c], &r[pc->b], fn->calls[pc->c].nargs);
+    NEXT();
+  CASE(BC_RET)
+    result = r[pc->a];
+    goto done;
+  VM_END()
+
+done:
+  phase_end(c);
+  unload_libraries(handles, num_libs);
+
+  return result;
+}